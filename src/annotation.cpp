@@ -1,3 +1,7 @@
+#include <algorithm>
+#include <cassert>
+#include <stdexcept>
+
 #include "annotation.hpp"
 
 using namespace std;
@@ -29,14 +33,34 @@ std::map<AnnotationType, QPen> Annotation::Styles = {
 QPen Annotation::CONFLICT_PEN = QPen(QBrush(QColor("#FF0000")), 3, Qt::SolidLine);
 
 AnnotationType annotationFromName(const std::string& name) {
-    for (const auto& kv : AnnotationNames) {
-        if (kv.second.first == name) return kv.first;
-    }
-    throw std::range_error("unknown annotation type " + name);
+    // reverse of AnnotationNames. Ambiguous names ('?') map to the first type using them
+    static const auto types = [] {
+        std::map<std::string, AnnotationType> types;
+        for (const auto& kv : AnnotationNames) types.insert({kv.second.first, kv.first});
+        return types;
+    }();
+
+    auto it = types.find(name);
+    if (it == types.end()) throw std::range_error("unknown annotation type " + name);
+    return it->second;
+}
+
+AnnotationType annotationFromName(const std::string& name, AnnotationCategory category) {
+    static const auto types = [] {
+        std::map<std::pair<std::string, AnnotationCategory>, AnnotationType> types;
+        for (const auto& kv : AnnotationNames) types.insert({kv.second, kv.first});
+        return types;
+    }();
+
+    auto it = types.find({name, category});
+    if (it == types.end()) throw std::range_error("unknown annotation type " + name);
+    return it->second;
 }
 
 
 Annotations::Annotations() :
+    currentRevision(0),
+    currentLayoutRevision(0),
     lockedCategories({{AnnotationCategory::TASK_ENGAGEMENT, true},
                        {AnnotationCategory::SOCIAL_ENGAGEMENT, true},
                        {AnnotationCategory::SOCIAL_ATTITUDE, true}})
@@ -44,63 +68,306 @@ Annotations::Annotations() :
 
 }
 
-void Annotations::updateActive(ros::Time time)
+size_t Annotations::countStartingBefore(const vector<AnnotationHandle>& sorted, ros::Time time) const
+{
+    return std::lower_bound(sorted.begin(), sorted.end(), time,
+                            [this](AnnotationHandle h, ros::Time t) {return starts[h] < t;})
+           - sorted.begin();
+}
+
+size_t Annotations::countStartingUntil(const vector<AnnotationHandle>& sorted, ros::Time time) const
+{
+    return std::upper_bound(sorted.begin(), sorted.end(), time,
+                            [this](ros::Time t, AnnotationHandle h) {return t < starts[h];})
+           - sorted.begin();
+}
+
+size_t Annotations::find(const vector<AnnotationHandle>& sorted, AnnotationHandle handle) const
+{
+    for (auto i = countStartingBefore(sorted, starts[handle]); i < sorted.size(); i++) {
+        if (sorted[i] == handle) return i;
+    }
+    assert(false);
+    return sorted.size();
+}
+
+void Annotations::updateMaxStop(CategoryIndex& idx, size_t from)
+{
+    for (auto i = from; i < idx.annotations.size(); i++) {
+        auto previous = (i == 0) ? ros::TIME_MIN : idx.maxStop[i - 1];
+        auto updated = std::max(previous, stops[idx.annotations[i]]);
+
+        // past the modified annotation, stop as soon as the running maximum is unchanged
+        if (i > from && idx.maxStop[i] == updated) break;
+        idx.maxStop[i] = updated;
+    }
+}
+
+AnnotationHandle Annotations::insert(const Annotation& annotation)
+{
+    AnnotationHandle handle;
+    if (!freeHandles.empty()) {
+        handle = freeHandles.back();
+        freeHandles.pop_back();
+    }
+    else {
+        handle = types.size();
+        types.emplace_back();
+        starts.emplace_back();
+        stops.emplace_back();
+        flags.emplace_back();
+    }
+
+    types[handle] = annotation.type;
+    starts[handle] = annotation.start;
+    stops[handle] = annotation.stop;
+    flags[handle] = LIVE | (annotation.isConflicted ? CONFLICTED : 0) | (flags[handle] & DIRTY);
+
+    link(handle);
+    touch(handle);
+    return handle;
+}
+
+void Annotations::erase(AnnotationHandle handle)
+{
+    unlink(handle);
+    flags[handle] &= DIRTY;
+    freeHandles.push_back(handle);
+    activeHandles.erase(std::remove(activeHandles.begin(), activeHandles.end(), handle), activeHandles.end());
+    touch(handle);
+}
+
+void Annotations::link(AnnotationHandle handle)
+{
+    annotations.insert(annotations.begin() + countStartingUntil(annotations, starts[handle]), handle);
+
+    auto& idx = index(category(handle));
+    auto pos = countStartingUntil(idx.annotations, starts[handle]);
+    idx.annotations.insert(idx.annotations.begin() + pos, handle);
+    idx.maxStop.insert(idx.maxStop.begin() + pos, stops[handle]);
+    updateMaxStop(idx, pos);
+}
+
+void Annotations::unlink(AnnotationHandle handle)
+{
+    annotations.erase(annotations.begin() + find(annotations, handle));
+
+    auto& idx = index(category(handle));
+    auto pos = find(idx.annotations, handle);
+    idx.annotations.erase(idx.annotations.begin() + pos);
+    idx.maxStop.erase(idx.maxStop.begin() + pos);
+    updateMaxStop(idx, pos);
+}
+
+void Annotations::setStart(AnnotationHandle handle, ros::Time start)
+{
+    // re-linking keeps both the global list and the category index sorted
+    unlink(handle);
+    starts[handle] = start;
+    link(handle);
+    touch(handle);
+}
+
+void Annotations::setStop(AnnotationHandle handle, ros::Time stop)
+{
+    stops[handle] = stop;
+
+    auto& idx = index(category(handle));
+    updateMaxStop(idx, find(idx.annotations, handle));
+    touch(handle);
+}
+
+void Annotations::clear()
+{
+    types.clear();
+    starts.clear();
+    stops.clear();
+    flags.clear();
+    freeHandles.clear();
+
+    annotations.clear();
+    for (auto& idx : categories) {
+        idx.annotations.clear();
+        idx.maxStop.clear();
+    }
+
+    activeHandles.clear();
+
+    changes.cleared = true;
+    changes.modified.clear();
+    currentRevision++;
+    currentLayoutRevision++;
+}
+
+void Annotations::touch(AnnotationHandle handle)
+{
+    // the dirty flag avoids listing a handle twice, without a lookup
+    if (!(flags[handle] & DIRTY)) {
+        flags[handle] |= DIRTY;
+        changes.modified.push_back(handle);
+    }
+    currentRevision++;
+    currentLayoutRevision++;
+}
+
+AnnotationChanges Annotations::takeChanges()
+{
+    for (auto handle : changes.modified) flags[handle] &= ~DIRTY;
+
+    AnnotationChanges taken;
+    std::swap(taken, changes);
+    std::sort(taken.modified.begin(), taken.modified.end());
+    return taken;
+}
+
+void Annotations::compact()
+{
+    vector<AnnotationHandle> renumbered(types.size());
+    for (size_t i = 0; i < annotations.size(); i++) renumbered[annotations[i]] = i;
+
+    vector<AnnotationType> compactTypes(annotations.size());
+    vector<ros::Time> compactStarts(annotations.size());
+    vector<ros::Time> compactStops(annotations.size());
+    vector<uint8_t> compactFlags(annotations.size());
+
+    for (size_t i = 0; i < annotations.size(); i++) {
+        auto handle = annotations[i];
+        compactTypes[i] = types[handle];
+        compactStarts[i] = starts[handle];
+        compactStops[i] = stops[handle];
+        compactFlags[i] = flags[handle] & ~DIRTY;
+        annotations[i] = i;
+    }
+
+    types.swap(compactTypes);
+    starts.swap(compactStarts);
+    stops.swap(compactStops);
+    flags.swap(compactFlags);
+    freeHandles.clear();
+
+    for (auto& idx : categories) {
+        for (auto& handle : idx.annotations) handle = renumbered[handle];
+    }
+    for (auto& handle : activeHandles) handle = renumbered[handle];
+
+    // the pending changes (including a clear) refer to the old handles
+    changes = AnnotationChanges();
+}
+
+AnnotationHandle Annotations::append(const Annotation &annotation)
+{
+    return insert(annotation);
+}
+
+void Annotations::restore(AnnotationHandle handle, const Annotation &annotation)
 {
+    if (isLive(handle)) unlink(handle);
+    else {
+        if (handle >= types.size()) {
+            // the slots in between are free until restored as well
+            for (auto h = types.size(); h < handle; h++) freeHandles.push_back(h);
+            types.resize(handle + 1);
+            starts.resize(handle + 1);
+            stops.resize(handle + 1);
+            flags.resize(handle + 1);
+        }
+        else {
+            freeHandles.erase(std::find(freeHandles.begin(), freeHandles.end(), handle));
+        }
+    }
+
+    types[handle] = annotation.type;
+    starts[handle] = annotation.start;
+    stops[handle] = annotation.stop;
+    flags[handle] = LIVE | (annotation.isConflicted ? CONFLICTED : 0) | (flags[handle] & DIRTY);
+
+    link(handle);
+    touch(handle);
+}
+
+void Annotations::remove(AnnotationHandle handle)
+{
+    if (isLive(handle)) erase(handle);
+}
 
-    // clean up annotations: all annotations with a null (or negative) duration are erased
-    annotations.erase(std::remove_if(annotations.begin(),
-                                     annotations.end(),
-                                     [](AnnotationPtr a){return a->start >= a->stop;}),
-                      annotations.end());
+void Annotations::updateActive(ros::Time time)
+{
+    // this happens at every tick of the playback: extending the active
+    // annotations does not change the layout, unless annotations start or
+    // stop being active
+    auto layoutRevision = currentLayoutRevision;
+    bool erased = false;
+    vector<AnnotationHandle> extended;
 
     for (auto category : AnnotationCategories) {
         if(isLocked(category)) continue;
 
-        auto active = getClosestStopTime(time, category);
-        if(active && active->stop < time) active->stop = time;
+        AnnotationHandle active;
+        if (!getClosestStopTime(time, category, active)) continue;
+
+        if(stops[active] < time) setStop(active, time);
+        extended.push_back(active);
+
+        AnnotationHandle next;
+        if(getNextInCategory(active, next) && starts[next] < time) {
+            setStart(next, time);
 
-        auto next = getNextInCategory(active);
-        if(next && next->start < time) next->start = time;
+            // all annotations with a null (or negative) duration are erased
+            if (starts[next] >= stops[next]) {
+                erase(next);
+                erased = true;
+            }
+            else extended.push_back(next);
+        }
     }
+
+    currentLayoutRevision = layoutRevision;
+    if (erased || extended != activeHandles) currentLayoutRevision++;
+    activeHandles.swap(extended);
 }
 
 /**
- * @brief Returns the annotation whose stop time is the closest to the current time (within the MAX_TIME_TO_MERGE threshold)
+ * @brief Looks for the annotation whose stop time is the closest to the current time (within the MAX_TIME_TO_MERGE threshold)
  * @param time
  * @param category: the returned annotation must belong to this category
- * @return
+ * @param closest: set to the handle of the annotation, if found
+ * @return true if such an annotation exists
  */
-AnnotationPtr Annotations::getClosestStopTime(ros::Time time, AnnotationCategory category) {
+bool Annotations::getClosestStopTime(ros::Time time, AnnotationCategory category, AnnotationHandle& closest) const {
 
-    AnnotationPtr closest = nullptr;
+    bool found = false;
 
-    for (auto a : annotations) {
-        if(   a->category() == category
-           && a->stop < time
-           && a->stop > time - MAX_TIME_TO_MERGE) {
-            if (   !closest
-                || (time - a->stop) < (time - closest->stop))
+    const auto& idx = index(category);
+
+    // only annotations starting before 'time' can stop before it. Walk them
+    // backward, until none can stop within the threshold anymore.
+    for (auto i = countStartingBefore(idx.annotations, time); i > 0 && idx.maxStop[i - 1] > time - MAX_TIME_TO_MERGE; i--) {
+        auto a = idx.annotations[i - 1];
+        if(   stops[a] < time
+           && stops[a] > time - MAX_TIME_TO_MERGE) {
+            if (   !found
+                || (time - stops[a]) < (time - stops[closest]))
             {
                 closest = a;
+                found = true;
             }
         }
     }
-    return closest;
+    return found;
 }
 
 /**
- * @brief returns the annotation following 'ref' in the timeline, *belonging to the same category* (or nullptr is none exist)
+ * @brief looks for the annotation following 'ref' in the timeline, *belonging to the same category*
+ * @return true if such an annotation exists
  */
-AnnotationPtr Annotations::getNextInCategory(AnnotationPtr ref) {
+bool Annotations::getNextInCategory(AnnotationHandle ref, AnnotationHandle& next) const {
 
-    bool foundmyself = false;
+    const auto& idx = index(category(ref));
+    auto pos = find(idx.annotations, ref);
+    if (pos + 1 >= idx.annotations.size()) return false;
 
-    // note that 'annotations' is always sorted by start time!
-    for (auto a : annotations) {
-        if(foundmyself && a->category() == ref->category()) return a;
-        if(a == ref) foundmyself = true;
-    }
-    return nullptr;
+    next = idx.annotations[pos + 1];
+    return true;
 }
 
 
@@ -111,22 +378,22 @@ void Annotations::add(Annotation annotation) {
     annotation.stop += ros::Duration(0.001); // make sure our annotation has a non-null duration
 
     // interrupt current annotation, if any
-    auto actives = getAnnotationsAt(annotation.start);
+    auto actives = getAnnotationsAt(annotation.start, annotation.category());
     for (auto a : actives) {
-        if(a->category() == annotation.category()) {
-            if(a->stop > annotation.stop) { // need to split!
-                Annotation a2(*a);
-                a2.start = annotation.stop;
-                annotations.push_back(std::make_shared<Annotation>(a2));
-            }
-            a->stop = annotation.start;
+        if(stops[a] > annotation.stop) { // need to split!
+            auto a2 = at(a);
+            a2.start = annotation.stop;
+            insert(a2);
         }
-    }
+        setStop(a, annotation.start);
 
+        // all annotations with a null (or negative) duration are erased
+        if (starts[a] >= stops[a]) erase(a);
+    }
 
-    annotations.push_back(std::make_shared<Annotation>(annotation));
+    if (annotation.start >= annotation.stop) return;
 
-    std::sort(annotations.begin(), annotations.end(), [](const AnnotationPtr a, const AnnotationPtr b) { return a->start < b->start; });
+    insert(annotation);
 }
 
 void Annotations::lockAllCategories()
@@ -147,35 +414,52 @@ ros::Time Annotations::lastStopTime() const
 {
     auto t = ros::TIME_MIN;
 
-    for (auto a : annotations) {
-        if (a->stop > t) t = a->stop;
+    for (const auto& idx : categories) {
+        if (!idx.maxStop.empty() && idx.maxStop.back() > t) t = idx.maxStop.back();
     }
     return t;
 }
 
 /**
- * @brief Returns the list of annotations at given time. Can be more than one when the stop time and start time of 2 annotations match
+ * @brief Returns the list of annotations of 'category' at given time. Can be more than one when the stop time and start time of 2 annotations match
  * @param time
  * @return
  */
-vector<AnnotationPtr> Annotations::getAnnotationsAt(ros::Time time)
+vector<AnnotationHandle> Annotations::getAnnotationsAt(ros::Time time, AnnotationCategory category) const
 {
-   vector<AnnotationPtr> res;
+   vector<AnnotationHandle> res;
 
-   if (annotations.empty()) return res;
+   const auto& idx = index(category);
 
-   for(size_t i = 0; i < annotations.size(); i++) {
-
-       if (   time <= annotations[i]->stop
-           && time >= annotations[i]->start)
-       {
-           res.push_back(annotations[i]);
-       }
+   // annotations starting at or before 'time', walked backward until none can
+   // reach 'time' anymore
+   for (auto i = countStartingUntil(idx.annotations, time); i > 0 && idx.maxStop[i - 1] >= time; i--) {
+       auto a = idx.annotations[i - 1];
+       if (time <= stops[a]) res.push_back(a);
    }
 
    return res;
 }
 
+vector<AnnotationHandle> Annotations::range(AnnotationCategory category, ros::Time from, ros::Time to) const
+{
+    vector<AnnotationHandle> res;
+
+    const auto& idx = index(category);
+
+    // maxStop is non-decreasing: the annotations before the first one whose
+    // running max stop time reaches 'from' all stop before it
+    auto first = std::lower_bound(idx.maxStop.begin(), idx.maxStop.end(), from) - idx.maxStop.begin();
+    auto last = countStartingUntil(idx.annotations, to);
+
+    for (auto i = static_cast<size_t>(first); i < last; i++) {
+        auto a = idx.annotations[i];
+        if (stops[a] >= from) res.push_back(a);
+    }
+
+    return res;
+}
+
 /**
  * Returns the type of the annotation at given time.
  * If no annotation exist at given time, returns MISSING.
@@ -184,18 +468,20 @@ vector<AnnotationPtr> Annotations::getAnnotationsAt(ros::Time time)
  */
 AnnotationType Annotations::getAnnotationTypeAt(ros::Time time) const
 {
-   if (annotations.empty()) return AnnotationType::MISSING;
-
-   for(size_t i = 0; i < annotations.size(); i++) {
-
-       if (   time < annotations[i]->stop
-           && time >= annotations[i]->start)
-       {
-           return annotations[i]->type;
+   bool found = false;
+   AnnotationHandle first = 0;
+
+   for (const auto& idx : categories) {
+       for (auto i = countStartingUntil(idx.annotations, time); i > 0 && idx.maxStop[i - 1] > time; i--) {
+           auto a = idx.annotations[i - 1];
+           if (time < stops[a] && (!found || starts[a] < starts[first])) {
+               first = a;
+               found = true;
+           }
        }
    }
 
-   return AnnotationType::MISSING;
+   return found ? types[first] : AnnotationType::MISSING;
 
 }
 
@@ -203,39 +489,20 @@ Annotations Annotations::filterByCategory(AnnotationCategory category) const
 {
    Annotations filtered;
 
-   for (auto a : annotations) {
-       if (AnnotationNames.at(a->type).second == category)
-           filtered.add(*a);
+   for (auto a : index(category).annotations) {
+       filtered.insert(at(a));
    }
 
    return filtered;
 }
 
-
-vector<AnnotationPtr> Annotations::getAnnotationsAtApprox(ros::Time time)
-{
-
-   vector<AnnotationPtr> res = getAnnotationsAt(time);
-
-   for(size_t i = 0; i < annotations.size(); i++) {
-
-       if (   time < (annotations[i]->stop + MAX_TIME_TO_MERGE)
-           && time > (annotations[i]->start - MAX_TIME_TO_MERGE))
-       {
-           res.push_back(annotations[i]);
-       }
-   }
-
-   return res;
-}
-
 YAML::Emitter& operator<< (YAML::Emitter& out, const Annotations& a)
 {
     out << YAML::BeginSeq;
-    for (const auto& annotation : a.annotations) {
+    for (auto handle : a.annotations) {
         out << YAML::BeginMap;
-        out << YAML::Key << AnnotationNames.at(annotation->type).first;
-        out << YAML::Value << vector<double>{annotation->start.toSec(), annotation->stop.toSec()};
+        out << YAML::Key << AnnotationNames.at(a.types[handle]).first;
+        out << YAML::Value << vector<double>{a.starts[handle].toSec(), a.stops[handle].toSec()};
         out << YAML::EndMap;
     }
     out << YAML::EndSeq;
@@ -243,83 +510,24 @@ YAML::Emitter& operator<< (YAML::Emitter& out, const Annotations& a)
 }
 
 
-Annotations diff(const Annotations &annotations1, const Annotations &annotations2)
+AnnotationType AnnotationCursor::at(ros::Time time)
 {
-
-    auto a1 = annotations1.filterByCategory(AnnotationCategory::TASK_ENGAGEMENT);
-    auto a2 = annotations2.filterByCategory(AnnotationCategory::TASK_ENGAGEMENT);
-
-
-    // first, calculate all the 'time splits', ie the time intervals resulting from the
-    // intersection of the 2 annotations streams.
-    vector<ros::Time> next_time_candidates;
-    size_t idx1 = 0;
-    size_t idx2 = 0;
-    auto current_time = min(a1[idx1]->start, a2[idx2]->start);
-    vector<ros::Time> time_splits {current_time};
-
-    while(true) {
-
-        if(idx1 < a1.size()) {
-            if(current_time < a1[idx1]->start)
-                next_time_candidates.push_back(a1[idx1]->start);
-            if(current_time < a1[idx1]->stop)
-                next_time_candidates.push_back(a1[idx1]->stop);
-        }
-
-        if(idx2 < a2.size()) {
-            if(current_time < a2[idx2]->start)
-                next_time_candidates.push_back(a2[idx2]->start);
-            if(current_time < a2[idx2]->stop)
-                next_time_candidates.push_back(a2[idx2]->stop);
-        }
-
-        ros::Time next_time_split = next_time_candidates[0];
-        for (auto t : next_time_candidates) {
-            next_time_split = min(next_time_split, t);
-        }
-
-        next_time_candidates.clear();
-
-        time_splits.push_back(next_time_split);
-        current_time = next_time_split;
-
-        if(idx1 < a1.size() && next_time_split == a1[idx1]->stop) idx1++;
-        if(idx2 < a2.size() && next_time_split == a2[idx2]->stop) idx2++;
-
-        if(idx1 >= a1.size() && idx2 >= a2.size()) break;
-    }
-
-    // second, for each time splits, check whether the two original annotation streams
-    // match. If they do not, set the resulting interval as 'CONFLICT'
-    Annotations diffs;
-    for (size_t t=0; t < time_splits.size() - 1; t++) {
-        auto type1 = a1.getAnnotationTypeAt(time_splits[t]);
-        auto type2 = a2.getAnnotationTypeAt(time_splits[t]);
-
-        if(type1 == type2) {
-            if(type1 == AnnotationType::MISSING) {continue;}
-            diffs.add({type1, time_splits[t], time_splits[t+1]});
-        }
-        else {
-            auto category = (type1 == AnnotationType::MISSING) ? AnnotationNames.at(type2).second : AnnotationNames.at(type1).second;
-            switch (category) {
-            case AnnotationCategory::TASK_ENGAGEMENT:
-                diffs.add({AnnotationType::OTHER_TASK_ENGAGEMENT, time_splits[t], time_splits[t+1], true}); // conflicted!
-                break;
-            case AnnotationCategory::SOCIAL_ENGAGEMENT:
-                diffs.add({AnnotationType::OTHER_SOCIAL_ENGAGEMENT, time_splits[t], time_splits[t+1], true}); // conflicted!
-                break;
-            case AnnotationCategory::SOCIAL_ATTITUDE:
-                diffs.add({AnnotationType::OTHER_SOCIAL_ATTITUDE, time_splits[t], time_splits[t+1], true}); // conflicted!
-                break;
-            default:
-                assert(false);
-                break;
-            }
-        }
+    while (idx < handles.size() && annotations.at(handles[idx]).stop <= time) idx++;
+    if (idx < handles.size()) {
+        const auto a = annotations.at(handles[idx]);
+        if (a.start <= time) return a.type;
     }
+    return AnnotationType::MISSING;
+}
 
-    return diffs;
+ros::Time AnnotationCursor::next(ros::Time time) const
+{
+    if (idx >= handles.size()) return ros::TIME_MAX;
+    const auto a = annotations.at(handles[idx]);
+    return a.start > time ? a.start : a.stop;
+}
 
+ros::Time AnnotationCursor::first() const
+{
+    return handles.size() ? annotations.at(handles[0]).start : ros::TIME_MAX;
 }
@@ -6,6 +6,8 @@
 #include <array>
 #include <tuple>
 #include <memory>
+#include <cstdint>
+#include <iterator>
 
 #include <QPen>
 #include <QBrush>
@@ -75,6 +77,8 @@ const std::map<AnnotationType, std::pair<std::string, AnnotationCategory>> Annot
 };
 
 AnnotationType annotationFromName(const std::string& name);
+/** Unlike names alone, (name, category) pairs are unique */
+AnnotationType annotationFromName(const std::string& name, AnnotationCategory category);
 
 struct Annotation
 {
@@ -94,9 +98,28 @@ struct Annotation
     AnnotationCategory category() const {return AnnotationNames.at(type).second;}
 };
 
-typedef typename std::shared_ptr<Annotation> AnnotationPtr;
-typedef typename std::shared_ptr<const Annotation> AnnotationConstPtr;
+/** Identifies an annotation within its Annotations set. A handle remains
+ * valid until the annotation is erased.
+ */
+typedef uint32_t AnnotationHandle;
 
+/** Changes made to a set of annotations, as returned by Annotations::takeChanges() */
+struct AnnotationChanges
+{
+    bool cleared = false; // all annotations were erased, before the changes listed below
+    std::vector<AnnotationHandle> modified; // handles of added, modified or erased annotations, sorted
+
+    bool empty() const {return !cleared && modified.empty();}
+};
+
+/**
+ * A set of annotations.
+ *
+ * The annotations are stored as a structure of arrays (types, start times,
+ * stop times, flags) indexed by handle: painting, diffing or saving streams
+ * through contiguous memory, without any per-annotation allocation. Slots of
+ * erased annotations are recycled.
+ */
 class Annotations
 {
 
@@ -106,22 +129,52 @@ public:
 
     friend YAML::Emitter& operator<< (YAML::Emitter& out, const Annotations& a);
 
-    typedef typename std::vector<AnnotationPtr>::iterator iterator;
-    typedef typename std::vector<AnnotationPtr>::const_iterator const_iterator;
-
-    iterator begin() {return annotations.begin();}
-    const_iterator begin() const {return annotations.begin();}
-    const_iterator cbegin() const {return annotations.cbegin();}
-    iterator end() {return annotations.end();}
-    const_iterator end() const {return annotations.end();}
-    const_iterator cend() const {return annotations.cend();}
-
-    AnnotationPtr& operator[](const int nIndex) {
-        return annotations[nIndex];
+    /**
+     * Iterates over the annotations, sorted by start time. Annotations are
+     * returned by value.
+     */
+    class const_iterator
+    {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef Annotation value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const Annotation* pointer;
+        typedef Annotation reference;
+
+        const_iterator(const Annotations* annotations, std::vector<AnnotationHandle>::const_iterator it) :
+            annotations(annotations), it(it) {}
+
+        Annotation operator*() const {return annotations->at(*it);}
+        AnnotationHandle handle() const {return *it;}
+
+        const_iterator& operator++() {++it; return *this;}
+        const_iterator operator++(int) {auto tmp = *this; ++it; return tmp;}
+        bool operator==(const const_iterator& other) const {return it == other.it;}
+        bool operator!=(const const_iterator& other) const {return it != other.it;}
+
+    private:
+        const Annotations* annotations;
+        std::vector<AnnotationHandle>::const_iterator it;
+    };
+    typedef const_iterator iterator;
+
+    const_iterator begin() const {return {this, annotations.cbegin()};}
+    const_iterator cbegin() const {return {this, annotations.cbegin()};}
+    const_iterator end() const {return {this, annotations.cend()};}
+    const_iterator cend() const {return {this, annotations.cend()};}
+
+    /** Returns the nth annotation, by start time */
+    Annotation operator[](size_t nIndex) const {
+        return at(annotations[nIndex]);
     }
-    const AnnotationPtr& operator[](const int nIndex) const {
+    /** Returns the handle of the nth annotation, by start time */
+    AnnotationHandle handle(size_t nIndex) const {
         return annotations[nIndex];
     }
+    Annotation at(AnnotationHandle handle) const {
+        return {types[handle], starts[handle], stops[handle], (flags[handle] & CONFLICTED) != 0};
+    }
     size_t size() const {
         return annotations.size();
     }
@@ -129,7 +182,7 @@ public:
 
     void updateActive(ros::Time time);
     void add(Annotation annotation);
-    void clear() {annotations.clear();}
+    void clear();
 
     bool isLocked(AnnotationCategory category) const {return lockedCategories.at(category);}
     void lock(AnnotationCategory category) {lockedCategories[category] = true;}
@@ -139,8 +192,55 @@ public:
 
     ros::Time lastStopTime() const;
 
+    /** Incremented by every change: unchanged annotations do not need to be saved again */
+    uint64_t revision() const {return currentRevision;}
+
+    /**
+     * Incremented by every change, except the ones updateActive() makes to
+     * the active annotations: as long as it does not change, a rendering of
+     * the other annotations remains valid.
+     */
+    uint64_t layoutRevision() const {return currentLayoutRevision;}
+
+    /** The annotations extended (or pushed back) by the last call to updateActive() */
+    const std::vector<AnnotationHandle>& active() const {return activeHandles;}
+
+    bool isLive(AnnotationHandle handle) const {return handle < flags.size() && (flags[handle] & LIVE);}
+
+    /** Returns the changes made since the last call, and starts tracking anew */
+    AnnotationChanges takeChanges();
+
+    /**
+     * Renumbers the handles so that they follow the start times, as they would
+     * be after re-loading the annotations with append(). Pending changes,
+     * including a clear, are discarded: only compact right after saving the
+     * annotations.
+     */
+    void compact();
+
+    /** Adds an annotation as is, without interrupting the ones it overlaps.
+     * Used to load saved annotations.
+     */
+    AnnotationHandle append(const Annotation& annotation);
+
+    /** Sets the annotation with the given handle, (re-)creating it if needed.
+     * Used to replay the annotation journal.
+     */
+    void restore(AnnotationHandle handle, const Annotation& annotation);
+    /** Erases the annotation with the given handle, if it exists. */
+    void remove(AnnotationHandle handle);
+
     AnnotationType getAnnotationTypeAt(ros::Time time) const;
 
+    /**
+     * Returns the annotations of 'category' overlapping [from, to], sorted by
+     * start time, in O(log n + k).
+     */
+    std::vector<AnnotationHandle> range(AnnotationCategory category, ros::Time from, ros::Time to) const;
+
+    /** Returns the handles of the annotations of 'category', sorted by start time */
+    const std::vector<AnnotationHandle>& byCategory(AnnotationCategory category) const {return index(category).annotations;}
+
     /** Returns a copy of the annotations, only keeping annotations belonging
      * to 'category'
      */
@@ -148,22 +248,96 @@ public:
 
 private:
 
+    // DIRTY: the handle is already listed in the pending changes
+    enum Flags : uint8_t {LIVE = 1, CONFLICTED = 2, DIRTY = 4};
+
+    uint64_t currentRevision;
+    uint64_t currentLayoutRevision;
+    std::vector<AnnotationHandle> activeHandles;
+
+    /**
+     * The annotations of one category, sorted by start time, augmented with
+     * the running maximum of their stop times: maxStop[i] is the latest stop
+     * time of annotations[0..i].
+     *
+     * The annotations overlapping a given time are found by binary search on
+     * the start times, then by walking backward until maxStop shows that no
+     * earlier annotation can reach that time. As annotations of a given
+     * category do not overlap (or barely), this is O(log n).
+     */
+    struct CategoryIndex {
+        std::vector<AnnotationHandle> annotations;
+        std::vector<ros::Time> maxStop;
+    };
+
     std::map<AnnotationCategory, bool> lockedCategories;
 
-    std::vector<AnnotationPtr> getAnnotationsAt(ros::Time time);
-    std::vector<AnnotationPtr> getAnnotationsAtApprox(ros::Time time);
+    // the store, indexed by handle
+    std::vector<AnnotationType> types;
+    std::vector<ros::Time> starts;
+    std::vector<ros::Time> stops;
+    std::vector<uint8_t> flags;
+    std::vector<AnnotationHandle> freeHandles;
+
+    AnnotationChanges changes;
+    void touch(AnnotationHandle handle);
+
+    // all the annotations, sorted by start time
+    std::vector<AnnotationHandle> annotations;
+
+    std::array<CategoryIndex, 4> categories; // one per AnnotationCategory, including OTHER
+    CategoryIndex& index(AnnotationCategory category) {return categories[static_cast<size_t>(category)];}
+    const CategoryIndex& index(AnnotationCategory category) const {return categories[static_cast<size_t>(category)];}
+
+    AnnotationCategory category(AnnotationHandle handle) const {return AnnotationNames.at(types[handle]).second;}
 
-    std::vector<AnnotationPtr> annotations;
+    /** returns the number of annotations in 'sorted' starting strictly before 'time' */
+    size_t countStartingBefore(const std::vector<AnnotationHandle>& sorted, ros::Time time) const;
+    /** returns the number of annotations in 'sorted' starting at or before 'time' */
+    size_t countStartingUntil(const std::vector<AnnotationHandle>& sorted, ros::Time time) const;
+    size_t find(const std::vector<AnnotationHandle>& sorted, AnnotationHandle handle) const;
+    /** recomputes maxStop, starting at position 'from' */
+    void updateMaxStop(CategoryIndex& idx, size_t from);
 
-    AnnotationPtr getNextInCategory(AnnotationPtr ref);
-    AnnotationPtr getClosestStopTime(ros::Time time, AnnotationCategory category);
+    AnnotationHandle insert(const Annotation& annotation);
+    void link(AnnotationHandle handle);
+    void unlink(AnnotationHandle handle);
+    void erase(AnnotationHandle handle);
+    void setStart(AnnotationHandle handle, ros::Time start);
+    void setStop(AnnotationHandle handle, ros::Time stop);
+
+    std::vector<AnnotationHandle> getAnnotationsAt(ros::Time time, AnnotationCategory category) const;
+
+    bool getNextInCategory(AnnotationHandle ref, AnnotationHandle& next) const;
+    bool getClosestStopTime(ros::Time time, AnnotationCategory category, AnnotationHandle& closest) const;
 };
 
 /**
-* Generates the 'diff' of 2 sets of annotations: a new annotations set representing only the differences between the 2
-* provided annotations sets.
-*/
-Annotations diff(const Annotations& annotations1, const Annotations& annotations2);
+ * Walks the annotations of a single category in increasing time order,
+ * returning the annotation type at a given time and the next time it may
+ * change. Several cursors advanced together sweep several sets of
+ * annotations in linear time.
+ */
+class AnnotationCursor
+{
+public:
+    AnnotationCursor(const Annotations& annotations, AnnotationCategory category) :
+        annotations(annotations), handles(annotations.byCategory(category)), idx(0) {}
+
+    /** Returns the type of the annotation at 'time' (or MISSING). 'time' must not decrease between calls. */
+    AnnotationType at(ros::Time time);
+
+    /** Returns the next time, after 'time', the annotation type may change (TIME_MAX if never) */
+    ros::Time next(ros::Time time) const;
+
+    /** Returns the start of the first annotation (TIME_MAX if none) */
+    ros::Time first() const;
+
+private:
+    const Annotations& annotations;
+    const std::vector<AnnotationHandle>& handles;
+    size_t idx;
+};
 
 
 #endif // ANNOTATION_H
@@ -0,0 +1,250 @@
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+
+#include <QDebug>
+#include <QFile>
+
+#include <yaml-cpp/yaml.h>
+
+#include "annotationio.hpp"
+#include "binaryio.hpp"
+
+using namespace std;
+
+const uint32_t ANNOTATIONS_VERSION = 1;
+
+const char ANNOTATIONS_MAGIC[] = "FPANN";
+
+// magic, version, journal generation, nb of purple and yellow annotations, nb of strings
+const size_t HEADER_SIZE = sizeof(ANNOTATIONS_MAGIC) + 4 + 8 + 4 + 4 + 4;
+
+enum RecordFlags : uint8_t {CONFLICTED = 1};
+
+struct AnnotationRecord {
+    uint32_t startSec, startNsec;
+    uint32_t stopSec, stopNsec;
+    uint16_t name; // index in the string table
+    uint8_t category;
+    uint8_t flags;
+};
+static_assert(sizeof(AnnotationRecord) == 20, "annotation records must be packed");
+
+AnnotationFormat formatFromPath(const string &path)
+{
+    for (const string ext : {".yaml", ".yml"}) {
+        if (path.size() >= ext.size() && path.compare(path.size() - ext.size(), ext.size(), ext) == 0) return AnnotationFormat::YAML;
+    }
+    return AnnotationFormat::BINARY;
+}
+
+template<typename T>
+static T readAt(const uchar* data, size_t& offset)
+{
+    T value;
+    memcpy(&value, data + offset, sizeof(T));
+    offset += sizeof(T);
+    return value;
+}
+
+static bool readBinary(const string &path, Annotations &purple, Annotations &yellow, uint64_t &generation)
+{
+    QFile file(QString::fromStdString(path));
+    if (!file.open(QIODevice::ReadOnly)) return false;
+
+    size_t size = file.size();
+    if (size < HEADER_SIZE) return false;
+
+    auto data = file.map(0, size);
+    if (!data) return false;
+
+    size_t offset = sizeof(ANNOTATIONS_MAGIC);
+    auto version = readAt<uint32_t>(data, offset);
+    auto journalGeneration = readAt<uint64_t>(data, offset);
+    auto nbPurple = readAt<uint32_t>(data, offset);
+    auto nbYellow = readAt<uint32_t>(data, offset);
+    auto nbStrings = readAt<uint32_t>(data, offset);
+
+    if (memcmp(data, ANNOTATIONS_MAGIC, sizeof(ANNOTATIONS_MAGIC)) != 0 || version != ANNOTATIONS_VERSION) {
+        qWarning() << QString::fromStdString(path) << "is not a supported annotation file";
+        return false;
+    }
+
+    auto records = offset;
+    offset += (static_cast<uint64_t>(nbPurple) + nbYellow) * sizeof(AnnotationRecord);
+    if (offset > size) return false;
+
+    vector<string> names;
+    for (uint32_t i = 0; i < nbStrings; i++) {
+        if (offset + sizeof(uint16_t) > size) return false;
+        auto len = readAt<uint16_t>(data, offset);
+        if (offset + len > size) return false;
+        names.emplace_back(reinterpret_cast<const char*>(data + offset), len);
+        offset += len;
+    }
+
+    Annotations p, y;
+    map<pair<uint16_t, uint8_t>, AnnotationType> types;
+
+    try {
+        offset = records;
+        for (uint64_t i = 0; i < static_cast<uint64_t>(nbPurple) + nbYellow; i++) {
+            auto r = readAt<AnnotationRecord>(data, offset);
+            if (r.name >= names.size()) return false;
+
+            auto it = types.find({r.name, r.category});
+            if (it == types.end()) {
+                auto type = annotationFromName(names[r.name], static_cast<AnnotationCategory>(r.category));
+                it = types.insert({{r.name, r.category}, type}).first;
+            }
+
+            (i < nbPurple ? p : y).append({it->second,
+                                           ros::Time(r.startSec, r.startNsec),
+                                           ros::Time(r.stopSec, r.stopNsec),
+                                           (r.flags & CONFLICTED) != 0});
+        }
+    }
+    catch (const range_error& e) {
+        qWarning() << "Unable to read" << QString::fromStdString(path) << ":" << e.what();
+        return false;
+    }
+
+    purple = move(p);
+    yellow = move(y);
+    generation = journalGeneration;
+    return true;
+}
+
+static void appendYaml(const YAML::Node& node, Annotations& annotations)
+{
+    for (const auto& as : node) {
+        for (const auto& a : as) {
+            auto type = annotationFromName(a.first.as<string>());
+            auto ts = a.second.as<vector<double>>();
+            annotations.append({type, ros::Time(ts[0]), ros::Time(ts[1])});
+        }
+    }
+}
+
+static bool readYaml(const string &path, Annotations &purple, Annotations &yellow, uint64_t &generation)
+{
+    Annotations p, y;
+
+    try {
+        YAML::Node node = YAML::LoadFile(path);
+        appendYaml(node["purple"], p);
+        appendYaml(node["yellow"], y);
+        generation = node["journal"] ? node["journal"].as<uint64_t>() : 0;
+    }
+    catch (const std::exception& e) {
+        qWarning() << "Unable to read" << QString::fromStdString(path) << ":" << e.what();
+        return false;
+    }
+
+    purple = move(p);
+    yellow = move(y);
+    return true;
+}
+
+bool readAnnotations(const string &path, Annotations &purple, Annotations &yellow, uint64_t &generation)
+{
+    char magic[sizeof(ANNOTATIONS_MAGIC)] = {};
+    {
+        ifstream in(path, ios::binary);
+        if (!in) {
+            qWarning() << "Unable to open" << QString::fromStdString(path);
+            return false;
+        }
+        in.read(magic, sizeof(magic));
+    }
+
+    bool ok;
+    if (equal(magic, magic + sizeof(magic), ANNOTATIONS_MAGIC)) ok = readBinary(path, purple, yellow, generation);
+    else ok = readYaml(path, purple, yellow, generation);
+    if (!ok) return false;
+
+    // freshly loaded annotations have nothing to journal
+    purple.takeChanges();
+    yellow.takeChanges();
+    return true;
+}
+
+static bool writeBinary(const string &path, const Annotations &purple, const Annotations &yellow, uint64_t generation)
+{
+    vector<string> names;
+    map<string, uint16_t> nameIndices;
+    vector<AnnotationRecord> records;
+    records.reserve(purple.size() + yellow.size());
+
+    for (const auto* annotations : {&purple, &yellow}) {
+        for (const auto& a : *annotations) {
+            auto name = a.name();
+            auto it = nameIndices.find(name);
+            if (it == nameIndices.end()) {
+                it = nameIndices.insert({name, names.size()}).first;
+                names.push_back(name);
+            }
+
+            AnnotationRecord r;
+            r.startSec = a.start.sec; r.startNsec = a.start.nsec;
+            r.stopSec = a.stop.sec; r.stopNsec = a.stop.nsec;
+            r.name = it->second;
+            r.category = static_cast<uint8_t>(a.category());
+            r.flags = a.isConflicted ? CONFLICTED : 0;
+            records.push_back(r);
+        }
+    }
+
+    ofstream out(path, ios::binary | ios::trunc);
+    out.write(ANNOTATIONS_MAGIC, sizeof(ANNOTATIONS_MAGIC));
+    writePod(out, ANNOTATIONS_VERSION);
+    writePod(out, generation);
+    writePod(out, static_cast<uint32_t>(purple.size()));
+    writePod(out, static_cast<uint32_t>(yellow.size()));
+    writePod(out, static_cast<uint32_t>(names.size()));
+    out.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(AnnotationRecord));
+    for (const auto& name : names) {
+        writePod(out, static_cast<uint16_t>(name.size()));
+        out.write(name.data(), name.size());
+    }
+
+    return static_cast<bool>(out.flush());
+}
+
+static bool writeYaml(const string &path, const Annotations &purple, const Annotations &yellow, uint64_t generation)
+{
+    YAML::Emitter out;
+
+    std::time_t t = std::time(nullptr);
+    std::tm tm = *std::localtime(&t);
+    stringstream ss;
+    ss << "Annotations made by " << qgetenv("USER").toStdString() << " on the " << std::put_time(&tm, "%Y-%m-%d %H:%M:%S");
+    out << YAML::Comment(ss.str());
+    out << YAML::BeginMap;
+    out << YAML::Key << "purple" << YAML::Value << purple;
+    out << YAML::Key << "yellow" << YAML::Value << yellow;
+    if (generation) out << YAML::Key << "journal" << YAML::Value << generation;
+    out << YAML::EndMap;
+
+    ofstream fout(path);
+    fout << out.c_str();
+    return static_cast<bool>(fout.flush());
+}
+
+bool writeAnnotations(const string &path, AnnotationFormat format,
+                      const Annotations &purple, const Annotations &yellow,
+                      uint64_t generation)
+{
+    switch (format) {
+    case AnnotationFormat::YAML:
+        return writeYaml(path, purple, yellow, generation);
+    case AnnotationFormat::BINARY:
+    default:
+        return writeBinary(path, purple, yellow, generation);
+    }
+}
@@ -0,0 +1,41 @@
+#ifndef ANNOTATIONIO_H
+#define ANNOTATIONIO_H
+
+#include <cstdint>
+#include <string>
+
+#include "annotation.hpp"
+
+/**
+ * Reading and writing of annotation files.
+ *
+ * The annotator natively uses a compact binary format ('.fpa'): a header,
+ * fixed-size records (purple annotations, then yellow ones), and a string
+ * table holding the names of the annotation types the records refer to.
+ * Files are memory-mapped when read.
+ *
+ * YAML files ('.yaml', '.yml') can still be imported and exported.
+ *
+ * Files written by the annotator record the generation of their journal
+ * (see AnnotationJournal), 0 if none.
+ */
+
+enum class AnnotationFormat {BINARY, YAML};
+
+/** Returns the format to use for 'path', based on its extension */
+AnnotationFormat formatFromPath(const std::string& path);
+
+/**
+ * Reads the annotations stored at 'path', whatever their format.
+ * Returns false (leaving 'purple' and 'yellow' untouched) if the file can not
+ * be read.
+ */
+bool readAnnotations(const std::string& path,
+                     Annotations& purple, Annotations& yellow,
+                     uint64_t& generation);
+
+bool writeAnnotations(const std::string& path, AnnotationFormat format,
+                      const Annotations& purple, const Annotations& yellow,
+                      uint64_t generation = 0);
+
+#endif // ANNOTATIONIO_H
@@ -0,0 +1,154 @@
+#include <chrono>
+#include <sstream>
+
+#include <QDebug>
+#include <QFile>
+
+#include "annotationjournal.hpp"
+
+using namespace std;
+
+const size_t AnnotationJournal::COMPACTION_THRESHOLD = 1000;
+// version 2 adds the conflicted flag to the S records
+const uint32_t AnnotationJournal::VERSION = 2;
+
+const char JOURNAL_MAGIC[] = "FPJ";
+
+static char streamCode(StreamType stream) {return stream == StreamType::YELLOW ? 'y' : 'p';}
+
+AnnotationJournal::AnnotationJournal()
+{
+}
+
+uint64_t AnnotationJournal::newGeneration()
+{
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
+}
+
+size_t AnnotationJournal::replay(const string &path, uint64_t generation,
+                                 Annotations &purple, Annotations &yellow)
+{
+    ifstream in(path);
+    if (!in) return 0;
+
+    string line;
+    if (!getline(in, line)) return 0;
+
+    string magic;
+    uint32_t version;
+    uint64_t journalGeneration;
+    istringstream header(line);
+    if (!(header >> magic >> version >> journalGeneration) || magic != JOURNAL_MAGIC || version < 1 || version > VERSION) {
+        qWarning() << "Ignoring invalid annotation journal" << QString::fromStdString(path);
+        return 0;
+    }
+    if (journalGeneration != generation) return 0; // journal of an older snapshot
+
+    uint64_t valid = in.tellg();
+    size_t nbRecords = 0;
+
+    // only complete lines are replayed: a record interrupted by a crash has no end of line
+    while (getline(in, line) && !in.eof()) {
+        istringstream record(line);
+        char op, stream;
+        if (!(record >> op >> stream) || (stream != 'p' && stream != 'y')) break;
+
+        auto& annotations = (stream == 'y') ? yellow : purple;
+
+        if (op == 'C') {
+            annotations.clear();
+        }
+        else if (op == 'S') {
+            AnnotationHandle handle;
+            int type;
+            uint32_t startsec, startnsec, stopsec, stopnsec;
+            int conflicted = 0;
+            if (!(record >> handle >> type >> startsec >> startnsec >> stopsec >> stopnsec)) break;
+            if (version >= 2 && !(record >> conflicted)) break;
+            if (type < 0 || type >= static_cast<int>(AnnotationType::MISSING)) break;
+            annotations.restore(handle, {static_cast<AnnotationType>(type),
+                                         ros::Time(startsec, startnsec),
+                                         ros::Time(stopsec, stopnsec),
+                                         conflicted != 0});
+        }
+        else if (op == 'D') {
+            AnnotationHandle handle;
+            if (!(record >> handle)) break;
+            annotations.remove(handle);
+        }
+        else break;
+
+        valid = in.tellg();
+        nbRecords++;
+    }
+
+    in.clear();
+    in.seekg(0, ios::end);
+    uint64_t filesize = in.tellg();
+    in.close();
+
+    // drop a record that was only partially written, so that new records can be appended
+    if (valid < filesize) QFile::resize(QString::fromStdString(path), valid);
+
+    return nbRecords;
+}
+
+void AnnotationJournal::reset(const string &path, uint64_t generation)
+{
+    if (out_.is_open()) out_.close();
+
+    path_ = path;
+
+    out_.open(path, ios::trunc);
+    if (!out_) {
+        qWarning() << "Unable to write the annotation journal to" << QString::fromStdString(path);
+        return;
+    }
+    out_ << JOURNAL_MAGIC << " " << VERSION << " " << generation << "\n";
+    out_.flush();
+}
+
+void AnnotationJournal::close()
+{
+    if (out_.is_open()) out_.close();
+}
+
+size_t AnnotationJournal::format(StreamType stream, const Annotations &annotations,
+                                 const AnnotationChanges &changes, string &records)
+{
+    auto code = streamCode(stream);
+    size_t nbRecords = 0;
+    ostringstream out;
+
+    if (changes.cleared) {
+        out << "C " << code << "\n";
+        nbRecords++;
+    }
+
+    for (auto handle : changes.modified) {
+        if (annotations.isLive(handle)) {
+            auto a = annotations.at(handle);
+            out << "S " << code << " " << handle << " " << static_cast<int>(a.type) << " "
+                << a.start.sec << " " << a.start.nsec << " "
+                << a.stop.sec << " " << a.stop.nsec << " "
+                << (a.isConflicted ? 1 : 0) << "\n";
+        }
+        else {
+            out << "D " << code << " " << handle << "\n";
+        }
+        nbRecords++;
+    }
+
+    records += out.str();
+    return nbRecords;
+}
+
+void AnnotationJournal::append(const string &records)
+{
+    if (!out_.is_open()) return;
+
+    out_ << records;
+    if (!out_.flush()) {
+        qWarning() << "Unable to write the annotation journal to" << QString::fromStdString(path_);
+    }
+}
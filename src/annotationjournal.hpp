@@ -0,0 +1,69 @@
+#ifndef ANNOTATIONJOURNAL_H
+#define ANNOTATIONJOURNAL_H
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+
+#include "annotation.hpp"
+
+/**
+ * Write-ahead journal of the changes made to the purple and yellow
+ * annotations since they were last saved.
+ *
+ * Each change is appended as a small text record holding the final state of
+ * one annotation (by handle), so that the cost of an autosave is
+ * proportional to the edits, not to the number of annotations. The journal
+ * is periodically compacted into the (binary) snapshot, and emptied.
+ *
+ * The journal and the snapshot share a generation number: a journal is only
+ * replayed over the snapshot it was started from. Handles are compacted
+ * when the snapshot is written, so that they match the ones obtained by
+ * re-loading it.
+ */
+class AnnotationJournal
+{
+public:
+
+    /** Number of records after which the journal should be compacted */
+    static const size_t COMPACTION_THRESHOLD;
+
+    AnnotationJournal();
+
+    /** Returns a new generation number, to be written in the next snapshot */
+    static uint64_t newGeneration();
+
+    /**
+     * Appends to 'records' the records describing the changes made to
+     * 'annotations'. Returns the number of records.
+     */
+    static size_t format(StreamType stream, const Annotations& annotations,
+                         const AnnotationChanges& changes, std::string& records);
+
+    /**
+     * Replays the journal at 'path' over annotations loaded from the snapshot
+     * of generation 'generation'. A record only partially written (eg, on
+     * crash) is dropped.
+     * Returns the number of records replayed.
+     */
+    static size_t replay(const std::string& path, uint64_t generation,
+                         Annotations& purple, Annotations& yellow);
+
+    /** (Re-)starts an empty journal at 'path', for the snapshot of generation 'generation' */
+    void reset(const std::string& path, uint64_t generation);
+
+    /** Stops journaling until the next reset */
+    void close();
+
+    /** Appends formatted records and flushes the journal */
+    void append(const std::string& records);
+
+private:
+
+    static const uint32_t VERSION;
+
+    std::string path_;
+    std::ofstream out_;
+};
+
+#endif // ANNOTATIONJOURNAL_H
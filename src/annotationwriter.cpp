@@ -0,0 +1,116 @@
+#include <chrono>
+#include <cstdio>
+
+#include <QDebug>
+
+#include "annotationio.hpp"
+#include "annotationwriter.hpp"
+
+using namespace std;
+
+AnnotationWriter::AnnotationWriter(QObject *parent) :
+    QObject(parent),
+    stopping_(false)
+{
+    thread_ = std::thread(&AnnotationWriter::run, this);
+}
+
+AnnotationWriter::~AnnotationWriter()
+{
+    {
+        lock_guard<mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    queued_.notify_all();
+    thread_.join();
+}
+
+void AnnotationWriter::appendToJournal(string records)
+{
+    if (records.empty()) return;
+
+    Job job;
+    job.records = move(records);
+    job.snapshot = false;
+    job.generation = 0;
+
+    {
+        lock_guard<mutex> lock(mutex_);
+        jobs_.push_back(move(job));
+    }
+    queued_.notify_all();
+}
+
+void AnnotationWriter::saveSnapshot(const string &path,
+                                    const Annotations &purple, const Annotations &yellow,
+                                    uint64_t generation)
+{
+    Job job;
+    job.snapshot = true;
+    job.path = path;
+    job.purple = purple;
+    job.yellow = yellow;
+    job.generation = generation;
+
+    {
+        lock_guard<mutex> lock(mutex_);
+        jobs_.push_back(move(job));
+    }
+    queued_.notify_all();
+}
+
+void AnnotationWriter::run()
+{
+    unique_lock<mutex> lock(mutex_);
+
+    while (true) {
+        queued_.wait(lock, [this]{return stopping_ || !jobs_.empty();});
+        if (jobs_.empty()) return; // only stop once everything is written
+
+        auto job = move(jobs_.front());
+        jobs_.pop_front();
+
+        lock.unlock();
+        if (job.snapshot) writeSnapshot(job);
+        else journal_.append(job.records);
+        lock.lock();
+    }
+}
+
+/** formats the records clearing 'annotations', then setting all of them */
+static void journalAll(StreamType stream, const Annotations& annotations, string& records)
+{
+    AnnotationChanges changes;
+    changes.cleared = true;
+    for (auto it = annotations.begin(); it != annotations.end(); ++it) changes.modified.push_back(it.handle());
+    AnnotationJournal::format(stream, annotations, changes, records);
+}
+
+void AnnotationWriter::writeSnapshot(const Job &job)
+{
+    auto start = chrono::steady_clock::now();
+
+    // write then rename, so that a crash never leaves a truncated file behind
+    auto tmppath = job.path + ".tmp";
+    if (   !writeAnnotations(tmppath, formatFromPath(job.path), job.purple, job.yellow, job.generation)
+        || std::rename(tmppath.c_str(), job.path.c_str()) != 0) {
+        qWarning() << "Unable to save the annotations to" << QString::fromStdString(job.path);
+        if (job.generation) {
+            // the previous snapshot and its journal remain the reference. The
+            // handles were compacted for this snapshot, though: the journal
+            // restarts from the annotations as compacted, so that the
+            // following records apply to them.
+            string records;
+            journalAll(StreamType::PURPLE, job.purple, records);
+            journalAll(StreamType::YELLOW, job.yellow, records);
+            journal_.append(records);
+        }
+        emit saveFailed(QString::fromStdString(job.path));
+        return;
+    }
+
+    if (job.generation) journal_.reset(job.path + ".journal", job.generation);
+
+    auto latency = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    emit saved(QString::fromStdString(job.path), latency);
+}
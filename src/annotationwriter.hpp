@@ -0,0 +1,76 @@
+#ifndef ANNOTATIONWRITER_H
+#define ANNOTATIONWRITER_H
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <QObject>
+#include <QString>
+
+#include "annotation.hpp"
+#include "annotationjournal.hpp"
+
+/**
+ * Writes the annotations to disk on a background thread, so that slow
+ * disks (or network shares) never stall the GUI.
+ *
+ * Journal records and snapshots are written in the order they are queued:
+ * the journal is only restarted once the snapshot that supersedes it has
+ * been fully written. Snapshots are written to a temporary file, then
+ * atomically renamed. If a snapshot fails, records keep going to the
+ * previous journal.
+ */
+class AnnotationWriter : public QObject
+{
+    Q_OBJECT
+
+public:
+
+    AnnotationWriter(QObject* parent = nullptr);
+    /** Waits for the queued writes to complete */
+    ~AnnotationWriter();
+
+    /** Queues journal records (see AnnotationJournal::format) */
+    void appendToJournal(std::string records);
+
+    /**
+     * Queues a snapshot of the annotations, to be written to 'path' (in the
+     * format matching its extension).
+     * If 'generation' is not null, the snapshot is tagged with it and the
+     * journal '<path>.journal' is then restarted.
+     */
+    void saveSnapshot(const std::string& path,
+                      const Annotations& purple, const Annotations& yellow,
+                      uint64_t generation = 0);
+
+    /** emitted once a snapshot is written, with the time it took (in ms) */
+    Q_SIGNAL void saved(QString path, double latency);
+    /** emitted when a snapshot can not be written */
+    Q_SIGNAL void saveFailed(QString path);
+
+private:
+
+    struct Job {
+        std::string records; // journal records, if not a snapshot
+        bool snapshot;
+        std::string path;
+        Annotations purple, yellow;
+        uint64_t generation;
+    };
+
+    void run();
+    void writeSnapshot(const Job& job);
+
+    AnnotationJournal journal_;
+
+    std::mutex mutex_;
+    std::condition_variable queued_;
+    std::deque<Job> jobs_;
+    bool stopping_;
+    std::thread thread_;
+};
+
+#endif // ANNOTATIONWRITER_H
@@ -1,4 +1,5 @@
 #include <QDebug>
+#include <QFontDatabase>
 #include <QKeyEvent>
 
 #include "annotatorwindow.hpp"
@@ -12,8 +13,16 @@ AnnotatorWindow::AnnotatorWindow(QWidget *parent) :
     ui->setupUi(this);
 
     ui->statusBar->addWidget(&bagInfo);
+    ui->statusBar->addWidget(&speedInfo);
+    ui->statusBar->addWidget(&prefetchInfo);
     autosaveInfo.setAlignment(Qt::AlignRight);
     ui->statusBar->addWidget(&autosaveInfo, 1);
+
+    pipelineOverlay.setParent(centralWidget());
+    pipelineOverlay.setFont(QFontDatabase::systemFont(QFontDatabase::FixedFont));
+    pipelineOverlay.setStyleSheet("QLabel {background: rgba(0, 0, 0, 180); color: white; padding: 6px;}");
+    pipelineOverlay.setAttribute(Qt::WA_TransparentForMouseEvents);
+    pipelineOverlay.hide();
 }
 
 AnnotatorWindow::~AnnotatorWindow()
@@ -27,12 +36,45 @@ void AnnotatorWindow::showBagInfo(ros::Duration time)
     bagInfo.setText(QString("%1:%2 (%3s)").arg(nbSec / 60,2,10,QChar('0')).arg(nbSec % 60,2,10,QChar('0')).arg(time.toSec()));
 }
 
+void AnnotatorWindow::showSpeed(float speed)
+{
+    if (speed == 1.f) speedInfo.clear();
+    else speedInfo.setText(QString("x%1").arg(speed));
+}
+
 void AnnotatorWindow::showAutosavePath(QString path)
 {
     autosaveInfo.setText(QString("Auto-saving to ") + path);
 
 }
 
+void AnnotatorWindow::showSaveLatency(QString path, double latency)
+{
+    autosaveInfo.setText(QString("Auto-saving to %1 (last saved in %2ms)").arg(path).arg(latency, 0, 'f', 1));
+}
+
+void AnnotatorWindow::showSaveError(QString path)
+{
+    autosaveInfo.setText(QString("Unable to save the annotations to %1!").arg(path));
+}
+
+void AnnotatorWindow::showPrefetchStats(const BagPrefetcher::Stats &stats)
+{
+    prefetchInfo.setText(QString("Read-ahead: %1/%2s, %3/%4MB, %5 underruns")
+                                .arg(stats.seconds, 0, 'f', 1)
+                                .arg(stats.readAhead, 0, 'f', 0)
+                                .arg(stats.bytes / (1024 * 1024))
+                                .arg(stats.maxBytes / (1024 * 1024))
+                                .arg(stats.underruns));
+}
+
+void AnnotatorWindow::showPipelineStats(const QString &report)
+{
+    pipelineOverlay.setText(report.trimmed());
+    pipelineOverlay.adjustSize();
+    pipelineOverlay.raise();
+}
+
 void AnnotatorWindow::keyPressEvent(QKeyEvent *event) {
 
     switch (event->key()) {
@@ -43,6 +85,9 @@ void AnnotatorWindow::keyPressEvent(QKeyEvent *event) {
         else
             setWindowState(Qt::WindowFullScreen);
         break;
+    case Qt::Key_F12:
+        pipelineOverlay.setVisible(!pipelineOverlay.isVisible());
+        break;
 
         ////// NOT HANDLED -> pass forward
     default:
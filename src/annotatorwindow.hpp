@@ -5,6 +5,8 @@
 #include <QLabel>
 #include <ros/time.h>
 
+#include "bagprefetcher.hpp"
+
 namespace Ui {
 class AnnotatorWindow;
 }
@@ -18,7 +20,14 @@ public:
     ~AnnotatorWindow();
 
     Q_SLOT void showBagInfo(ros::Duration time);
+    Q_SLOT void showSpeed(float speed);
     Q_SLOT void showAutosavePath(QString path);
+    Q_SLOT void showSaveLatency(QString path, double latency);
+    Q_SLOT void showSaveError(QString path);
+    void showPrefetchStats(const BagPrefetcher::Stats& stats);
+    /** whether the pipeline statistics overlay is shown (toggled with F12) */
+    bool pipelineStatsShown() const {return pipelineOverlay.isVisible();}
+    void showPipelineStats(const QString& report);
 
     virtual void keyPressEvent(QKeyEvent* event) override;
 
@@ -26,7 +35,10 @@ private:
     Ui::AnnotatorWindow *ui;
 
     QLabel bagInfo;
+    QLabel speedInfo;
+    QLabel prefetchInfo;
     QLabel autosaveInfo;
+    QLabel pipelineOverlay;
 };
 
 #endif // ANNOTATORWINDOW_H
@@ -0,0 +1,372 @@
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+
+#include <QDebug>
+#include <QDateTime>
+#include <QFileInfo>
+
+#include <rosbag/bag.h>
+#include <rosbag/view.h>
+#include "audio_common_msgs/AudioData.h"
+
+#include "audiowaveform.hpp"
+#include "binaryio.hpp"
+
+using namespace std;
+
+const int AudioWaveform::SAMPLE_RATE = 16000;
+const int AudioWaveform::BIN_SIZE = 256;
+const uint32_t AudioWaveform::VERSION = 2;
+
+const char WAVEFORM_MAGIC[] = "FPWAV";
+
+const AudioWaveform::Peak EMPTY_PEAK {1.f, -1.f, 0.f};
+
+AudioWaveform::AudioWaveform(QObject *parent) :
+    QObject(parent),
+    maxAmplitude_(0.f),
+    current_(EMPTY_PEAK),
+    currentCount_(0),
+    position_(0),
+    stopping_(false),
+    pipeline_(nullptr)
+{
+}
+
+AudioWaveform::~AudioWaveform()
+{
+    stop();
+}
+
+void AudioWaveform::stop()
+{
+    stopping_ = true;
+    {
+        // the decoding thread may be blocked pushing to a full appsrc: only
+        // a flushing pipeline wakes it up
+        lock_guard<mutex> lock(pipelineMutex_);
+        if (pipeline_) gst_element_set_state(pipeline_, GST_STATE_NULL);
+    }
+    if (thread_.joinable()) thread_.join();
+}
+
+void AudioWaveform::build(const string &bagpath, const string &topic)
+{
+    stop();
+    stopping_ = false;
+
+    QFileInfo fi(QString::fromStdString(bagpath));
+    uint64_t bagsize = fi.size();
+    int64_t bagmtime = fi.lastModified().toMSecsSinceEpoch();
+
+    cachepath_ = bagpath + ".waveform";
+
+    {
+        lock_guard<mutex> lock(mutex_);
+        levels_.clear();
+        maxAmplitude_ = 0.f;
+    }
+    current_ = EMPTY_PEAK;
+    currentCount_ = 0;
+    position_ = 0;
+
+    if (readCache(bagsize, bagmtime)) {
+        qDebug() << "Audio waveform loaded from" << QString::fromStdString(cachepath_);
+        return;
+    }
+
+    thread_ = std::thread(&AudioWaveform::decode, this, bagpath, topic, bagsize, bagmtime);
+}
+
+vector<AudioWaveform::Peak> AudioWaveform::peaks(ros::Time from, ros::Duration step, size_t count) const
+{
+    vector<Peak> res(count, EMPTY_PEAK);
+
+    lock_guard<mutex> lock(mutex_);
+
+    if (levels_.empty() || step <= ros::Duration(0)) return res;
+
+    // coarsest level whose peaks are not larger than one step: each step then
+    // spans at most 3 peaks
+    double binDuration = double(BIN_SIZE) / SAMPLE_RATE;
+    size_t level = 0;
+    while (level + 1 < levels_.size() && binDuration * 2 <= step.toSec()) {
+        level++;
+        binDuration *= 2;
+    }
+    const auto& bins = levels_[level];
+
+    auto offset = (from - start_).toSec();
+
+    for (size_t i = 0; i < count; i++) {
+        auto t0 = offset + i * step.toSec();
+        auto t1 = t0 + step.toSec();
+
+        auto b0 = max(0l, static_cast<long>(floor(t0 / binDuration)));
+        auto b1 = min(static_cast<long>(bins.size()), static_cast<long>(ceil(t1 / binDuration)));
+
+        auto& peak = res[i];
+        int nb = 0;
+        for (auto b = b0; b < b1; b++) {
+            if (bins[b].isEmpty()) continue;
+            peak.min = min(peak.min, bins[b].min);
+            peak.max = max(peak.max, bins[b].max);
+            peak.meansquare += bins[b].meansquare;
+            nb++;
+        }
+        if (nb > 0) peak.meansquare /= nb;
+    }
+
+    return res;
+}
+
+float AudioWaveform::maxAmplitude() const
+{
+    lock_guard<mutex> lock(mutex_);
+    return maxAmplitude_;
+}
+
+void AudioWaveform::addPeak(size_t level, const Peak &peak)
+{
+    if (levels_.size() <= level) levels_.resize(level + 1);
+
+    auto& bins = levels_[level];
+    bins.push_back(peak);
+
+    if (bins.size() % 2 == 0) {
+        const auto& a = bins[bins.size() - 2];
+        const auto& b = bins.back();
+        addPeak(level + 1, {min(a.min, b.min), max(a.max, b.max), (a.meansquare + b.meansquare) / 2});
+    }
+}
+
+void AudioWaveform::flushPeak()
+{
+    current_.meansquare /= currentCount_;
+    {
+        lock_guard<mutex> lock(mutex_);
+        addPeak(0, current_);
+        maxAmplitude_ = max(maxAmplitude_, max(-current_.min, current_.max));
+    }
+    current_ = EMPTY_PEAK;
+    currentCount_ = 0;
+}
+
+void AudioWaveform::addSamples(const float *samples, size_t count, int64_t position)
+{
+    // a gap in the recording is left empty, so that the following samples
+    // land at the time of their message. Smaller jitter is ignored.
+    if (position > position_ + BIN_SIZE) {
+        if (currentCount_ > 0) flushPeak();
+        {
+            lock_guard<mutex> lock(mutex_);
+            auto bin = static_cast<size_t>(position / BIN_SIZE);
+            while (levels_.empty() || levels_[0].size() < bin) addPeak(0, EMPTY_PEAK);
+        }
+        position_ = position;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        auto s = samples[i];
+        current_.min = min(current_.min, s);
+        current_.max = max(current_.max, s);
+        current_.meansquare += s * s;
+        position_++;
+
+        if (++currentCount_ == BIN_SIZE) flushPeak();
+    }
+
+    if (ros::WallTime::now() - lastUpdate_ > ros::WallDuration(1.)) {
+        lastUpdate_ = ros::WallTime::now();
+        emit waveformUpdated();
+    }
+}
+
+GstFlowReturn AudioWaveform::cb_new_sample(GstElement *appsink, gpointer user_data)
+{
+    AudioWaveform *waveform = reinterpret_cast<AudioWaveform*>(user_data);
+
+    GstSample *sample = nullptr;
+    g_signal_emit_by_name(appsink, "pull-sample", &sample);
+    if (!sample) return GST_FLOW_EOS;
+
+    GstBuffer *buffer = gst_sample_get_buffer(sample);
+
+    // timestamps are relative to the first audio message (see decode())
+    int64_t position = -1;
+    if (GST_BUFFER_PTS_IS_VALID(buffer)) {
+        position = gst_util_uint64_scale(GST_BUFFER_PTS(buffer), SAMPLE_RATE, GST_SECOND);
+    }
+
+    GstMapInfo map;
+    if (gst_buffer_map(buffer, &map, GST_MAP_READ)) {
+        waveform->addSamples(reinterpret_cast<const float*>(map.data), map.size / sizeof(float), position);
+        gst_buffer_unmap(buffer, &map);
+    }
+    gst_sample_unref(sample);
+
+    return waveform->stopping_ ? GST_FLOW_EOS : GST_FLOW_OK;
+}
+
+void AudioWaveform::decode(string bagpath, string topic, uint64_t bagsize, int64_t bagmtime)
+{
+    // the playback has its own handle on the bag: rosbag::Bag is not thread-safe
+    rosbag::Bag bag;
+    try {
+        bag.open(bagpath, rosbag::bagmode::Read);
+    }
+    catch (const rosbag::BagException& e) {
+        qWarning() << "Unable to decode the audio:" << e.what();
+        return;
+    }
+
+    rosbag::View view(bag, rosbag::TopicQuery(topic));
+    if (view.begin() == view.end()) return;
+
+    // decode as fast as possible (no clock sync) to mono float samples
+    // buffers are timestamped with their message time: the decoded samples can be placed accordingly
+    auto description = "appsrc name=source format=time block=true max-bytes=1048576 "
+                       "! decodebin ! audioconvert ! audioresample "
+                       "! audio/x-raw,format=F32LE,channels=1,rate=" + to_string(SAMPLE_RATE) + " "
+                       "! appsink name=sink emit-signals=true sync=false";
+
+    GError *error = nullptr;
+    GstElement *pipeline = gst_parse_launch(description.c_str(), &error);
+    if (!pipeline) {
+        qWarning() << "Unable to create the audio decoding pipeline:" << error->message;
+        g_error_free(error);
+        return;
+    }
+
+    GstElement *source = gst_bin_get_by_name(GST_BIN(pipeline), "source");
+    GstElement *sink = gst_bin_get_by_name(GST_BIN(pipeline), "sink");
+    g_signal_connect(sink, "new-sample", G_CALLBACK(cb_new_sample), this);
+
+    {
+        lock_guard<mutex> lock(pipelineMutex_);
+        // stop() may have been called before the pipeline was published
+        if (!stopping_) {
+            pipeline_ = pipeline;
+            gst_element_set_state(pipeline, GST_STATE_PLAYING);
+        }
+    }
+
+    qDebug() << "Decoding the audio track...";
+
+    bool first = true;
+    ros::Time start;
+    GstFlowReturn ret;
+
+    for (rosbag::MessageInstance const m : view) {
+        if (stopping_) break;
+
+        auto msg = m.instantiate<audio_common_msgs::AudioData>();
+        if (!msg) continue;
+
+        if (first) {
+            lock_guard<mutex> lock(mutex_);
+            start = start_ = m.getTime();
+            first = false;
+        }
+
+        GstBuffer *buffer = gst_buffer_new_and_alloc(msg->data.size());
+        gst_buffer_fill(buffer, 0, &msg->data[0], msg->data.size());
+        GST_BUFFER_PTS(buffer) = (m.getTime() - start).toNSec();
+        g_signal_emit_by_name(source, "push-buffer", buffer, &ret);
+        gst_buffer_unref(buffer);
+
+        if (ret != GST_FLOW_OK) break;
+    }
+
+    g_signal_emit_by_name(source, "end-of-stream", &ret);
+
+    // wait for the decoder to process the remaining buffers. Polled, so
+    // that stopping does not wait for it, and bounded in case it stalls.
+    GstBus *bus = gst_element_get_bus(pipeline);
+    GstMessage *msg = nullptr;
+    for (int i = 0; i < 300 && !msg && !stopping_; i++) {
+        msg = gst_bus_timed_pop_filtered(bus, 100 * GST_MSECOND,
+                                         static_cast<GstMessageType>(GST_MESSAGE_EOS | GST_MESSAGE_ERROR));
+    }
+    bool complete = !stopping_ && msg && GST_MESSAGE_TYPE(msg) == GST_MESSAGE_EOS;
+    if (msg) gst_message_unref(msg);
+    gst_object_unref(bus);
+
+    {
+        lock_guard<mutex> lock(pipelineMutex_);
+        pipeline_ = nullptr;
+    }
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+    gst_object_unref(source);
+    gst_object_unref(sink);
+    gst_object_unref(pipeline);
+
+    if (complete) {
+        writeCache(bagsize, bagmtime);
+        qDebug() << "Audio waveform saved to" << QString::fromStdString(cachepath_);
+    }
+
+    emit waveformUpdated();
+}
+
+bool AudioWaveform::readCache(uint64_t bagsize, int64_t bagmtime)
+{
+    ifstream in(cachepath_, ios::binary);
+    if (!in) return false;
+
+    char magic[sizeof(WAVEFORM_MAGIC)];
+    uint32_t version;
+    uint64_t size;
+    int64_t mtime;
+
+    if (!in.read(magic, sizeof(magic)) || !equal(magic, magic + sizeof(magic), WAVEFORM_MAGIC)) return false;
+    if (!readPod(in, version) || version != VERSION) return false;
+    if (!readPod(in, size) || size != bagsize) return false;
+    if (!readPod(in, mtime) || mtime != bagmtime) return false;
+
+    uint32_t sec, nsec;
+    uint64_t nbPeaks;
+    if (!readPod(in, sec) || !readPod(in, nsec) || !readPod(in, nbPeaks)) return false;
+
+    // a corrupted count must not trigger a huge allocation
+    auto start = in.tellg();
+    in.seekg(0, ios::end);
+    uint64_t remaining = in.tellg() - start;
+    in.seekg(start);
+    if (nbPeaks > remaining / sizeof(Peak)) return false;
+
+    vector<Peak> peaks(nbPeaks);
+    if (!in.read(reinterpret_cast<char*>(peaks.data()), nbPeaks * sizeof(Peak))) return false;
+
+    lock_guard<mutex> lock(mutex_);
+    start_ = ros::Time(sec, nsec);
+    for (const auto& peak : peaks) {
+        addPeak(0, peak);
+        maxAmplitude_ = max(maxAmplitude_, max(-peak.min, peak.max));
+    }
+
+    return true;
+}
+
+void AudioWaveform::writeCache(uint64_t bagsize, int64_t bagmtime) const
+{
+    ofstream out(cachepath_, ios::binary | ios::trunc);
+    if (!out) {
+        qWarning() << "Unable to write the audio waveform to" << QString::fromStdString(cachepath_);
+        return;
+    }
+
+    lock_guard<mutex> lock(mutex_);
+
+    out.write(WAVEFORM_MAGIC, sizeof(WAVEFORM_MAGIC));
+    writePod(out, VERSION);
+    writePod(out, bagsize);
+    writePod(out, bagmtime);
+    writePod(out, start_.sec);
+    writePod(out, start_.nsec);
+
+    const auto& peaks = levels_.empty() ? vector<Peak>() : levels_[0];
+    writePod(out, static_cast<uint64_t>(peaks.size()));
+    out.write(reinterpret_cast<const char*>(peaks.data()), peaks.size() * sizeof(Peak));
+}
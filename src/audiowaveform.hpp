@@ -0,0 +1,103 @@
+#ifndef AUDIOWAVEFORM_H
+#define AUDIOWAVEFORM_H
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <QObject>
+#include <gst/gst.h>
+#include <ros/time.h>
+
+/**
+ * Min/max/RMS envelope of the audio track of a bag, used to draw a
+ * waveform in the timeline.
+ *
+ * The audio is decoded once, in the background, through a GStreamer
+ * pipeline. The envelope is stored as a pyramid: level 0 holds one peak
+ * per BIN_SIZE samples, and each level above merges two peaks of the level
+ * below. Any zoom level can therefore be rendered in O(pixels).
+ *
+ * Samples are placed according to the timestamps of their messages: gaps in
+ * the recording are left as empty peaks, and the waveform stays aligned with
+ * the video.
+ *
+ * Level 0 is cached next to the bag as '<bag>.waveform'.
+ */
+class AudioWaveform : public QObject
+{
+    Q_OBJECT
+
+public:
+
+    struct Peak {
+        float min, max;
+        float meansquare;
+
+        bool isEmpty() const {return min > max;}
+    };
+
+    static const int SAMPLE_RATE;
+    static const int BIN_SIZE;
+
+    AudioWaveform(QObject* parent = nullptr);
+    ~AudioWaveform();
+
+    /**
+     * Loads the cached envelope of the bag at 'bagpath' or, if missing or
+     * stale, starts decoding 'topic' in the background.
+     */
+    void build(const std::string& bagpath, const std::string& topic);
+
+    /**
+     * Returns 'count' peaks, each covering 'step', starting at 'from'.
+     * Peaks that are not (yet) known are empty.
+     * Thread-safe.
+     */
+    std::vector<Peak> peaks(ros::Time from, ros::Duration step, size_t count) const;
+
+    /** the largest absolute amplitude seen so far */
+    float maxAmplitude() const;
+
+    /** emitted regularly while the audio is being decoded */
+    Q_SIGNAL void waveformUpdated();
+
+private:
+
+    static const uint32_t VERSION;
+
+    static GstFlowReturn cb_new_sample(GstElement *appsink, gpointer user_data);
+
+    /** stops the decoding (if any), and waits for it */
+    void stop();
+    void decode(std::string bagpath, std::string topic, uint64_t bagsize, int64_t bagmtime);
+    /** 'position' is the index of the first sample since start_, if known (-1 otherwise) */
+    void addSamples(const float* samples, size_t count, int64_t position);
+    void addPeak(size_t level, const Peak& peak);
+    void flushPeak();
+
+    bool readCache(uint64_t bagsize, int64_t bagmtime);
+    void writeCache(uint64_t bagsize, int64_t bagmtime) const;
+
+    std::string cachepath_;
+
+    mutable std::mutex mutex_;
+    ros::Time start_; // timestamp of the first audio sample
+    std::vector<std::vector<Peak>> levels_;
+    float maxAmplitude_;
+
+    // level-0 peak being accumulated by the decoder
+    Peak current_;
+    int currentCount_;
+    int64_t position_; // index of the next sample since start_
+    ros::WallTime lastUpdate_;
+
+    std::atomic<bool> stopping_;
+    std::mutex pipelineMutex_;
+    GstElement* pipeline_; // while decoding
+    std::thread thread_;
+};
+
+#endif // AUDIOWAVEFORM_H
@@ -0,0 +1,166 @@
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+
+#include <QDebug>
+#include <QDateTime>
+#include <QFileInfo>
+
+#include <rosbag/view.h>
+
+#include "bagindex.hpp"
+#include "binaryio.hpp"
+
+using namespace std;
+
+const uint32_t BagIndex::VERSION = 1;
+
+const char INDEX_MAGIC[] = "FPIDX";
+
+BagIndex::BagIndex() :
+    begin_(ros::TIME_MIN),
+    end_(ros::TIME_MAX)
+{
+}
+
+void BagIndex::load(rosbag::Bag &bag, const string &bagpath, const vector<string> &topics)
+{
+    QFileInfo fi(QString::fromStdString(bagpath));
+    uint64_t bagsize = fi.size();
+    int64_t bagmtime = fi.lastModified().toMSecsSinceEpoch();
+
+    auto cachepath = bagpath + ".index";
+
+    timestamps_.clear();
+
+    if (readCache(cachepath, bagsize, bagmtime)) {
+        qDebug() << "Bag index loaded from" << QString::fromStdString(cachepath);
+        return;
+    }
+    // whatever a truncated or corrupted cache left behind is rebuilt from scratch
+    timestamps_.clear();
+    begin_ = ros::TIME_MIN;
+    end_ = ros::TIME_MAX;
+
+    qDebug() << "Building the bag index...";
+    build(bag, topics);
+    writeCache(cachepath, bagsize, bagmtime);
+    qDebug() << "Bag index saved to" << QString::fromStdString(cachepath);
+}
+
+const vector<ros::Time>& BagIndex::timestamps(const string &topic) const
+{
+    static const vector<ros::Time> none;
+
+    auto it = timestamps_.find(topic);
+    if (it == timestamps_.end()) return none;
+    return it->second;
+}
+
+ros::Time BagIndex::seek(const string &topic, ros::Time time) const
+{
+    const auto& ts = timestamps(topic);
+
+    auto it = std::upper_bound(ts.begin(), ts.end(), time);
+    if (it == ts.begin()) return time;
+    return *(--it);
+}
+
+void BagIndex::build(rosbag::Bag &bag, const vector<string> &topics)
+{
+    rosbag::View bagview(bag);
+    begin_ = bagview.getBeginTime();
+    end_ = bagview.getEndTime();
+
+    for (const auto& topic : topics) timestamps_[topic];
+
+    // iterating over a view only walks the bag's connection index:
+    // messages are not read nor deserialized until instantiated.
+    rosbag::View view(bag, rosbag::TopicQuery(topics));
+    for (rosbag::MessageInstance const m : view) {
+        timestamps_[m.getTopic()].push_back(m.getTime());
+    }
+}
+
+bool BagIndex::readCache(const string &path, uint64_t bagsize, int64_t bagmtime)
+{
+    ifstream in(path, ios::binary);
+    if (!in) return false;
+
+    char magic[sizeof(INDEX_MAGIC)];
+    uint32_t version;
+    uint64_t size;
+    int64_t mtime;
+
+    if (!in.read(magic, sizeof(magic)) || !equal(magic, magic + sizeof(magic), INDEX_MAGIC)) return false;
+    if (!readPod(in, version) || version != VERSION) return false;
+    if (!readPod(in, size) || size != bagsize) return false;
+    if (!readPod(in, mtime) || mtime != bagmtime) return false;
+
+    uint32_t sec, nsec;
+    if (!readPod(in, sec) || !readPod(in, nsec)) return false;
+    begin_ = ros::Time(sec, nsec);
+    if (!readPod(in, sec) || !readPod(in, nsec)) return false;
+    end_ = ros::Time(sec, nsec);
+
+    uint32_t nbTopics;
+    if (!readPod(in, nbTopics)) return false;
+
+    // a corrupted count must not trigger a huge allocation: each timestamp takes 8 bytes
+    auto start = in.tellg();
+    in.seekg(0, ios::end);
+    uint64_t remaining = in.tellg() - start;
+    in.seekg(start);
+
+    for (uint32_t i = 0; i < nbTopics; i++) {
+        uint32_t len;
+        if (!readPod(in, len)) return false;
+        string topic(len, '\0');
+        if (!in.read(&topic[0], len)) return false;
+
+        uint64_t nbMsgs;
+        if (!readPod(in, nbMsgs) || nbMsgs > remaining / (2 * sizeof(uint32_t))) return false;
+        auto& ts = timestamps_[topic];
+        ts.reserve(nbMsgs);
+        for (uint64_t j = 0; j < nbMsgs; j++) {
+            if (!readPod(in, sec) || !readPod(in, nsec)) return false;
+            ts.push_back(ros::Time(sec, nsec));
+        }
+    }
+
+    return true;
+}
+
+void BagIndex::writeCache(const string &path, uint64_t bagsize, int64_t bagmtime) const
+{
+    // written aside then renamed over the cache: an interrupted write never leaves a truncated index behind
+    auto tmppath = path + ".tmp";
+    ofstream out(tmppath, ios::binary | ios::trunc);
+    if (!out) {
+        qWarning() << "Unable to write the bag index to" << QString::fromStdString(path);
+        return;
+    }
+
+    out.write(INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    writePod(out, VERSION);
+    writePod(out, bagsize);
+    writePod(out, bagmtime);
+    writePod(out, begin_.sec); writePod(out, begin_.nsec);
+    writePod(out, end_.sec); writePod(out, end_.nsec);
+
+    writePod(out, static_cast<uint32_t>(timestamps_.size()));
+    for (const auto& kv : timestamps_) {
+        writePod(out, static_cast<uint32_t>(kv.first.size()));
+        out.write(kv.first.data(), kv.first.size());
+        writePod(out, static_cast<uint64_t>(kv.second.size()));
+        for (const auto& t : kv.second) {
+            writePod(out, t.sec); writePod(out, t.nsec);
+        }
+    }
+
+    out.close();
+    if (!out || std::rename(tmppath.c_str(), path.c_str()) != 0) {
+        qWarning() << "Unable to write the bag index to" << QString::fromStdString(path);
+        std::remove(tmppath.c_str());
+    }
+}
@@ -0,0 +1,61 @@
+#ifndef BAGINDEX_H
+#define BAGINDEX_H
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <ros/time.h>
+#include <rosbag/bag.h>
+
+/**
+ * Per-topic index of the message timestamps of a bag file.
+ *
+ * The index is built once by walking the bag's own connection index (no
+ * message payload is read) and cached next to the bag, as '<bag>.index'.
+ * The cache is only reused if the size and modification time of the bag
+ * still match the ones recorded when the index was built.
+ *
+ * Lookups are binary searches over sorted timestamps.
+ */
+class BagIndex
+{
+public:
+
+    BagIndex();
+
+    /**
+     * Loads the index of 'bag' from its cache, or (re-)builds it if the
+     * cache is missing or stale.
+     */
+    void load(rosbag::Bag& bag, const std::string& bagpath, const std::vector<std::string>& topics);
+
+    bool empty() const {return timestamps_.empty();}
+
+    ros::Time begin() const {return begin_;}
+    ros::Time end() const {return end_;}
+
+    /** Returns the (sorted) timestamps of all the messages published on 'topic'.
+     */
+    const std::vector<ros::Time>& timestamps(const std::string& topic) const;
+
+    /**
+     * Returns the timestamp of the last message on 'topic' at or before
+     * 'time', ie the message that was 'current' at 'time'.
+     * If no such message exists, returns 'time'.
+     */
+    ros::Time seek(const std::string& topic, ros::Time time) const;
+
+private:
+
+    static const uint32_t VERSION;
+
+    bool readCache(const std::string& path, uint64_t bagsize, int64_t bagmtime);
+    void writeCache(const std::string& path, uint64_t bagsize, int64_t bagmtime) const;
+    void build(rosbag::Bag& bag, const std::vector<std::string>& topics);
+
+    ros::Time begin_, end_;
+    std::map<std::string, std::vector<ros::Time>> timestamps_;
+};
+
+#endif // BAGINDEX_H
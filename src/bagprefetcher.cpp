@@ -0,0 +1,179 @@
+#include <rosbag/view.h>
+
+#include "bagprefetcher.hpp"
+
+using namespace std;
+
+const size_t BagPrefetcher::CAPACITY = 8192;
+
+BagPrefetcher::BagPrefetcher(rosbag::Bag &bag) :
+    bag_(bag),
+    readAhead_(5.),
+    maxBytes_(256 * 1024 * 1024),
+    ring_(CAPACITY),
+    head_(0),
+    count_(0),
+    bytes_(0),
+    generation_(0),
+    seekRequested_(false),
+    eof_(false),
+    delivered_(false),
+    starved_(false),
+    underruns_(0),
+    stopping_(false)
+{
+    thread_ = std::thread(&BagPrefetcher::run, this);
+}
+
+BagPrefetcher::~BagPrefetcher()
+{
+    {
+        lock_guard<mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    changed_.notify_all();
+    thread_.join();
+}
+
+void BagPrefetcher::setReadAhead(ros::Duration readAhead, size_t maxBytes)
+{
+    {
+        lock_guard<mutex> lock(mutex_);
+        readAhead_ = readAhead;
+        maxBytes_ = maxBytes;
+    }
+    changed_.notify_all();
+}
+
+void BagPrefetcher::seek(const vector<pair<string, ros::Time>> &starts, ros::Time end)
+{
+    {
+        lock_guard<mutex> lock(mutex_);
+
+        generation_++;
+        starts_ = starts;
+        end_ = end;
+        seekRequested_ = true;
+        eof_ = false;
+
+        for (auto& msg : ring_) msg = PrefetchedMessage();
+        head_ = count_ = bytes_ = 0;
+
+        delivered_ = starved_ = false;
+    }
+    changed_.notify_all();
+}
+
+BagPrefetcher::Status BagPrefetcher::pop(PrefetchedMessage &msg, chrono::milliseconds timeout)
+{
+    unique_lock<mutex> lock(mutex_);
+
+    if (count_ == 0 && !eof_ && delivered_ && !starved_) {
+        starved_ = true;
+        underruns_++;
+    }
+
+    if (!changed_.wait_for(lock, timeout, [this]{return count_ > 0 || eof_;})) return Status::TIMEOUT;
+
+    if (count_ == 0) return Status::END;
+
+    msg = move(ring_[head_]);
+    ring_[head_] = PrefetchedMessage();
+    head_ = (head_ + 1) % ring_.size();
+    count_--;
+    bytes_ -= msg.bytes;
+
+    delivered_ = true;
+    starved_ = false;
+
+    lock.unlock();
+    changed_.notify_all();
+
+    return Status::MESSAGE;
+}
+
+BagPrefetcher::Stats BagPrefetcher::stats() const
+{
+    lock_guard<mutex> lock(mutex_);
+
+    Stats stats;
+    stats.messages = count_;
+    stats.bytes = bytes_;
+    stats.maxBytes = maxBytes_;
+    stats.seconds = 0.;
+    if (count_ > 0) {
+        const auto& last = ring_[(head_ + count_ - 1) % ring_.size()];
+        stats.seconds = (last.time - ring_[head_].time).toSec();
+    }
+    stats.readAhead = readAhead_.toSec();
+    stats.underruns = underruns_;
+    return stats;
+}
+
+bool BagPrefetcher::isFull() const
+{
+    if (count_ == 0) return false;
+    if (count_ == ring_.size() || bytes_ >= maxBytes_) return true;
+
+    const auto& last = ring_[(head_ + count_ - 1) % ring_.size()];
+    return last.time - ring_[head_].time >= readAhead_;
+}
+
+void BagPrefetcher::run()
+{
+    unique_lock<mutex> lock(mutex_);
+
+    while (true) {
+        changed_.wait(lock, [this]{return stopping_ || seekRequested_;});
+        if (stopping_) return;
+
+        seekRequested_ = false;
+        auto generation = generation_;
+        auto starts = starts_;
+        auto end = end_;
+
+        lock.unlock();
+
+        rosbag::View view;
+        for (const auto& start : starts) {
+            view.addQuery(bag_, rosbag::TopicQuery(start.first), start.second, end);
+        }
+
+        for (rosbag::MessageInstance const m : view) {
+
+            // reading (and decompressing the chunk) happens here, without
+            // holding the lock
+            auto readStart = ros::WallTime::now();
+            PrefetchedMessage msg;
+            msg.time = m.getTime();
+            msg.topic = m.getTopic();
+            msg.image = m.instantiate<sensor_msgs::CompressedImage>();
+            if (msg.image) {
+                msg.bytes = msg.image->data.size();
+            }
+            else {
+                msg.audio = m.instantiate<audio_common_msgs::AudioData>();
+                if (!msg.audio) continue;
+                msg.bytes = msg.audio->data.size();
+            }
+            msg.readTime = ros::WallTime::now() - readStart;
+
+            lock.lock();
+            changed_.wait(lock, [&]{return stopping_ || generation != generation_ || !isFull();});
+            if (stopping_ || generation != generation_) break;
+
+            bytes_ += msg.bytes;
+            ring_[(head_ + count_) % ring_.size()] = move(msg);
+            count_++;
+
+            lock.unlock();
+            changed_.notify_all();
+        }
+
+        if (!lock.owns_lock()) lock.lock();
+        if (generation == generation_) {
+            eof_ = true;
+            changed_.notify_all();
+        }
+    }
+}
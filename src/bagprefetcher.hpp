@@ -0,0 +1,106 @@
+#ifndef BAGPREFETCHER_H
+#define BAGPREFETCHER_H
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <ros/time.h>
+#include <rosbag/bag.h>
+#include <sensor_msgs/CompressedImage.h>
+#include "audio_common_msgs/AudioData.h"
+
+struct PrefetchedMessage
+{
+    ros::Time time;
+    std::string topic;
+
+    // only one of them is set
+    sensor_msgs::CompressedImageConstPtr image;
+    audio_common_msgs::AudioDataConstPtr audio;
+
+    size_t bytes = 0;
+    ros::WallDuration readTime; // to read and deserialize the message
+};
+
+/**
+ * Reads (and deserializes) the messages of a bag ahead of playback, on a
+ * background thread.
+ *
+ * Messages are kept in a ring buffer bounded both in bag time ('readAhead')
+ * and in memory ('maxBytes'), so that disk or network hiccups are absorbed
+ * by the buffer instead of stalling the playback.
+ *
+ * Once started, the prefetcher is the only user of the bag.
+ */
+class BagPrefetcher
+{
+public:
+
+    enum class Status {MESSAGE, TIMEOUT, END};
+
+    struct Stats {
+        size_t messages;    // currently buffered
+        size_t bytes;       // size of the buffered messages
+        size_t maxBytes;
+        double seconds;     // bag time spanned by the buffered messages
+        double readAhead;
+        uint64_t underruns; // number of times the playback found the buffer empty
+    };
+
+    BagPrefetcher(rosbag::Bag& bag);
+    ~BagPrefetcher();
+
+    void setReadAhead(ros::Duration readAhead, size_t maxBytes);
+
+    /**
+     * Drops the buffered messages and starts reading again. Each topic is
+     * read from its own start time, until 'end'.
+     */
+    void seek(const std::vector<std::pair<std::string, ros::Time>>& starts, ros::Time end);
+
+    /**
+     * Pops the next message, waiting at most 'timeout' for it to be read.
+     */
+    Status pop(PrefetchedMessage& msg, std::chrono::milliseconds timeout);
+
+    Stats stats() const;
+
+private:
+
+    static const size_t CAPACITY;
+
+    void run();
+    bool isFull() const;
+
+    rosbag::Bag& bag_;
+
+    ros::Duration readAhead_;
+    size_t maxBytes_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable changed_;
+
+    std::vector<PrefetchedMessage> ring_;
+    size_t head_, count_, bytes_;
+
+    // incremented on each seek, to discard messages read for a previous request
+    uint64_t generation_;
+    std::vector<std::pair<std::string, ros::Time>> starts_;
+    ros::Time end_;
+    bool seekRequested_;
+    bool eof_;
+
+    bool delivered_; // at least one message popped since the last seek
+    bool starved_;
+    uint64_t underruns_;
+
+    bool stopping_;
+    std::thread thread_;
+};
+
+#endif // BAGPREFETCHER_H
@@ -1,18 +1,15 @@
+#include <algorithm>
 #include <vector>
 #include <string>
 #include <chrono>
-#include <thread> // for sleep_for when paused
 
 #include <QTimerEvent>
 #include <QDebug>
-#include <QCoreApplication>
 
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/highgui/highgui.hpp>
 #include <sensor_msgs/CompressedImage.h>
 
-#include <rosbag/view.h>
-
 #include "bagreader.hpp"
 
 using namespace std;
@@ -24,23 +21,62 @@ const string CAM_YELLOW("camera_yellow/rgb/image_raw/compressed");
 const string CAM_ENV("env_camera/qhd/image_color/compressed");
 const string SANDTRAY_BG("/sandtray/background/image/compressed");
 
-BagReader::BagReader(QObject *parent) :
+const string& cameraTopic(VideoStream stream)
+{
+    switch (stream) {
+    case VideoStream::ENV: return CAM_ENV;
+    case VideoStream::PURPLE: return CAM_PURPLE;
+    case VideoStream::YELLOW: return CAM_YELLOW;
+    case VideoStream::SANDTRAY: return SANDTRAY_BG;
+    }
+    return CAM_ENV;
+}
+
+const string& audioTopic()
+{
+    return AUDIO_PURPLE;
+}
+
+const vector<string> CAMERA_TOPICS = {CAM_ENV, CAM_PURPLE, CAM_YELLOW, SANDTRAY_BG};
+const vector<string> TOPICS = {AUDIO_PURPLE, CAM_ENV, CAM_PURPLE, CAM_YELLOW, SANDTRAY_BG};
+
+// how often the prefetcher is polled when it lags behind the playback (in ms)
+const int PREFETCH_POLL_INTERVAL = 5;
+
+// when playing faster than real time, at most one frame per display refresh is decoded
+const ros::WallDuration MIN_FRAME_INTERVAL(1. / 60);
+
+const float BagReader::MIN_SPEED = 0.25f;
+const float BagReader::MAX_SPEED = 8.f;
+
+BagReader::BagReader(TaskPool &pool, QObject *parent) :
     QObject(parent),
     running_(false),
     paused_(false),
+    hasPending_(false),
+    reachedEnd_(false),
     begin_(ros::TIME_MIN),
     end_(ros::TIME_MAX),
-    time_scale_(1)
+    time_scale_(1),
+    stats_(nullptr),
+    prefetcher_(bag_),
+    decoder_(pool, [this](VideoStream stream, const cv::Mat& frame, ros::WallTime due) {
+        switch (stream) {
+        case VideoStream::ENV: emit envImgReady(frame, due); break;
+        case VideoStream::PURPLE: emit purpleImgReady(frame, due); break;
+        case VideoStream::YELLOW: emit yellowImgReady(frame, due); break;
+        case VideoStream::SANDTRAY: emit sandtrayImgReady(frame, due); break;
+        }
+    })
 {
 
-
 }
 
 void BagReader::start()
 {
     running_ = true;
     emit started();
-    processBag();
+    restart();
 }
 
 void BagReader::stop()
@@ -48,6 +84,7 @@ void BagReader::stop()
     qDebug() << "Closing the bag.";
     paused_ = false;
     running_ = false;
+    m_timer.stop();
 }
 
 void BagReader::togglePause()
@@ -68,14 +105,24 @@ void BagReader::resume()
     qDebug() << "Resumed";
     paused_ = false;
     emit resumed();
+
+    // once the end is reached, resuming plays again from begin_
+    if (reachedEnd_) {
+        restart();
+        return;
+    }
+
+    // the playback resumes from the current position, now
+    resetTimeTranslation(current_);
+    schedule(0);
 }
 
 void BagReader::jumpBy(int secs)
 {
     begin_ = current_ = std::min(bag_end_, std::max(bag_begin_, current_ + ros::Duration(secs)));
-    emit timeUpdate(current_);
-    emit durationUpdate(current_ - bag_begin_);
-    restartProcess_ = true;
+    clock_.publish(current_);
+    emit seeked(current_);
+    restart();
 
 }
 
@@ -94,10 +141,46 @@ void BagReader::jumpTo(int secs)
 
     current_ = begin_;
 
-    emit timeUpdate(current_);
-    emit durationUpdate(current_ - bag_begin_);
+    clock_.publish(current_);
+    emit seeked(current_);
 
-    restartProcess_ = true;
+    restart();
+}
+
+void BagReader::setSpeed(float speed)
+{
+    time_scale_ = std::min(MAX_SPEED, std::max(MIN_SPEED, speed));
+    qDebug() << "Playback speed:" << time_scale_;
+
+    // the next message is rescheduled at the new speed
+    resetTimeTranslation(current_);
+    if (!paused_) schedule(0);
+
+    emit speedChanged(time_scale_);
+}
+
+void BagReader::faster()
+{
+    setSpeed(time_scale_ * 2);
+}
+
+void BagReader::slower()
+{
+    setSpeed(time_scale_ / 2);
+}
+
+void BagReader::stepFrame(VideoStream stream, int frames)
+{
+    if (!paused_) pause();
+
+    const auto& timestamps = index_.timestamps(cameraTopic(stream));
+    if (timestamps.empty()) return;
+
+    // the frame currently displayed is the latest one at or before current_
+    long pos = std::upper_bound(timestamps.begin(), timestamps.end(), current_) - timestamps.begin() - 1;
+    pos = std::min(std::max(pos + frames, 0L), static_cast<long>(timestamps.size()) - 1);
+
+    setPlayTime(timestamps[pos]);
 }
 
 void BagReader::loadBag(const std::__cxx11::string &path)
@@ -106,92 +189,164 @@ void BagReader::loadBag(const std::__cxx11::string &path)
     bag_.open(path, rosbag::bagmode::Read);
     qDebug() << "Loading completed.";
 
-    rosbag::View bagview(bag_);
+    index_.load(bag_, path, TOPICS);
 
-    bag_begin_ = begin_ = current_ = bagview.getBeginTime();
-    bag_end_ = end_ = bagview.getEndTime();
+    bag_begin_ = begin_ = current_ = index_.begin();
+    bag_end_ = end_ = index_.end();
 
     emit bagLoaded(bag_begin_, bag_end_);
 }
 
-void BagReader::processBag()
+void BagReader::restart()
 {
-    vector<string> topics = {AUDIO_PURPLE, CAM_ENV, CAM_PURPLE, CAM_YELLOW, SANDTRAY_BG};
+    if (!running_) return;
+
+    // each camera stream restarts from the frame that was current at
+    // begin_ (looked up in the index), so that every pane shows the right
+    // image straight after a seek, even for sparse topics like the
+    // sandtray background.
+    vector<pair<string, ros::Time>> starts {{AUDIO_PURPLE, begin_}};
+    for (const auto& topic : CAMERA_TOPICS) {
+        starts.emplace_back(topic, index_.seek(topic, begin_));
+    }
+    prefetcher_.seek(starts, end_);
+    hasPending_ = false;
+    reachedEnd_ = false;
+
+    // frames still being decoded belong to the previous position
+    decoder_.flush();
+
+    resetTimeTranslation(begin_);
 
-    while(running_) {
-        rosbag::View view;
-        view.addQuery(bag_, rosbag::TopicQuery(topics), begin_, end_);
+    // even when paused, the frames at the new position are displayed
+    schedule(0);
+}
 
-        // configure the time translator
+void BagReader::resetTimeTranslation(ros::Time time)
+{
+    // the translator scales bag durations into wall-clock durations
+    time_translator_.setTimeScale(1. / time_scale_);
+    time_translator_.setRealStartTime(time);
+    ros::WallTime now_wt = ros::WallTime::now();
+    time_translator_.setTranslatedStartTime(ros::Time(now_wt.sec, now_wt.nsec));
+}
 
-        time_translator_.setTimeScale(1);
-        time_translator_.setRealStartTime(view.getBeginTime());
-        ros::WallTime now_wt = ros::WallTime::now();
-        time_translator_.setTranslatedStartTime(ros::Time(now_wt.sec, now_wt.nsec));
+void BagReader::schedule(int msecs)
+{
+    if (!running_) return;
+    m_timer.start(msecs, Qt::PreciseTimer, this);
+}
 
-        for(rosbag::MessageInstance const m : view)
-        {
+void BagReader::timerEvent(QTimerEvent *event)
+{
+    if (event->timerId() != m_timer.timerId()) {
+        QObject::timerEvent(event);
+        return;
+    }
+    m_timer.stop();
 
-            if(paused_) {
-                auto paused_time_ = ros::WallTime::now();
-                while(paused_ && running_) {
-                    QCoreApplication::processEvents();
-                    std::this_thread::sleep_for(milliseconds(10));
-                }
-                ros::WallDuration shift = ros::WallTime::now() - paused_time_;
-                time_translator_.shift(ros::Duration(shift.sec, shift.nsec));
-            }
+    playDueMessages();
+}
 
-            if(!running_ || restartProcess_) {
-                restartProcess_ = false;
-                break;
-            }
+void BagReader::playDueMessages()
+{
+    while (running_) {
 
-            ros::Time const& time = m.getTime();
+        if (!hasPending_) {
+            auto status = prefetcher_.pop(pending_, milliseconds(0));
 
-            if (time >= bag_end_) {
-                pause();
-                emit timeUpdate(current_);
-                emit durationUpdate(current_ - bag_begin_);
-                break;
-            }
+            if (status == BagPrefetcher::Status::END) return;
 
-            current_ = time;
-            emit timeUpdate(time);
-            emit durationUpdate(time - bag_begin_);
+            if (status == BagPrefetcher::Status::TIMEOUT) {
+                // the prefetcher is lagging behind
+                schedule(PREFETCH_POLL_INTERVAL);
+                return;
+            }
+            hasPending_ = true;
+        }
 
-            ros::Time translated = time_translator_.translate(current_);
-            ros::WallTime horizon = ros::WallTime(translated.sec, translated.nsec);
-            ros::WallTime::sleepUntil(horizon);
+        ros::Time const& time = pending_.time;
 
-            if(m.getTopic() == AUDIO_PURPLE) {
-                auto msg = m.instantiate<audio_common_msgs::AudioData>();
+        if (time >= bag_end_) {
+            pause();
+            clock_.publish(current_);
+            reachedEnd_ = true;
+            return;
+        }
 
-                emit audioFrameReady(msg);
+        // frames older than begin_ are only there to 'catch up' after a
+        // seek: display them straight away, without moving the playhead
+        if (time >= begin_) {
 
+            if (paused_) {
+                // the message stays pending until resumed, except for the
+                // frames at the very position we seeked to
+                if (time > begin_ || !pending_.image) return;
             }
             else {
-                auto compressed_rgb = m.instantiate<sensor_msgs::CompressedImage>();
-                if (compressed_rgb != NULL) {
-                    auto cvimg = cv::imdecode(compressed_rgb->data,1);
-
-                    if(m.getTopic() == CAM_ENV) emit envImgReady(cvimg);
-                    else if(m.getTopic() == CAM_PURPLE) emit purpleImgReady(cvimg);
-                    else if(m.getTopic() == CAM_YELLOW) emit yellowImgReady(cvimg);
-                    else if(m.getTopic() == SANDTRAY_BG) emit sandtrayImgReady(cvimg);
+                ros::Time translated = time_translator_.translate(time);
+                auto wait = (ros::WallTime(translated.sec, translated.nsec) - ros::WallTime::now()).toSec();
+                if (wait > 0.001) {
+                    schedule(static_cast<int>(wait * 1000));
+                    return;
                 }
             }
 
-            QCoreApplication::processEvents();
+            current_ = time;
+            clock_.publish(time);
+        }
+
+        if(pending_.audio) {
+            emit audioFrameReady(pending_.audio);
         }
+        else if (pending_.image) {
+            // decoding happens on the decode pool: this thread only
+            // schedules the messages read by the prefetcher
+            for (auto stream : {VideoStream::ENV, VideoStream::PURPLE, VideoStream::YELLOW, VideoStream::SANDTRAY}) {
+                if (pending_.topic != cameraTopic(stream)) continue;
+
+                if (stats_) stats_->record(stream, PipelineStats::Stage::READ, pending_.readTime);
+
+                // catching up frames are always decoded
+                if (time <= begin_ || !skipFrame(stream)) decoder_.decode(stream, pending_.image);
+                else if (stats_) stats_->dropped(stream, PipelineStats::Stage::DECODE);
+                break;
+            }
+        }
+
+        pending_ = PrefetchedMessage();
+        hasPending_ = false;
     }
 }
 
+bool BagReader::skipFrame(VideoStream stream)
+{
+    // when playing fast, frames would replace each other faster than the
+    // display refreshes: the ones that cannot be shown are not even decoded
+    auto now = ros::WallTime::now();
+    auto& last = lastDecoded_[static_cast<size_t>(stream)];
+    if (time_scale_ > 1.f && now - last < MIN_FRAME_INTERVAL) return true;
+
+    last = now;
+    return false;
+}
+
+void BagReader::setPipelineStats(PipelineStats *stats)
+{
+    stats_ = stats;
+    decoder_.setStats(stats);
+}
+
+void BagReader::setReadAhead(double seconds, size_t megabytes)
+{
+    prefetcher_.setReadAhead(ros::Duration(seconds), megabytes * 1024 * 1024);
+}
+
 void BagReader::setPlayTime(ros::Time time)
 {
     begin_ = current_ = time;
-    emit timeUpdate(time);
-    emit durationUpdate(time - bag_begin_);
-    restartProcess_ = true;
+    clock_.publish(time);
+    emit seeked(time);
+    restart();
 }
 
@@ -1,6 +1,7 @@
 #ifndef BAGREADER_H
 #define BAGREADER_H
 
+#include <array>
 #include <mutex>
 #include <condition_variable>
 
@@ -13,13 +14,26 @@
 #include <rosbag/time_translator.h>
 #include "audio_common_msgs/AudioData.h"
 
+#include "bagindex.hpp"
+#include "bagprefetcher.hpp"
+#include "framedecoder.hpp"
+#include "pipelinestats.hpp"
+#include "playbackclock.hpp"
+#include "taskpool.hpp"
+
+/** Returns the bag topic of a camera stream */
+const std::string& cameraTopic(VideoStream stream);
+/** Returns the bag topic of the audio stream */
+const std::string& audioTopic();
+
 class BagReader : public QObject
 {
     Q_OBJECT
     QBasicTimer m_timer;
     QScopedPointer<cv::VideoCapture> m_videoCapture;
 public:
-    BagReader(QObject * parent = {});
+    /** frames are decoded on 'pool' */
+    BagReader(TaskPool& pool, QObject * parent = {});
 
     Q_SIGNAL void started();
     Q_SLOT void start();
@@ -39,37 +53,124 @@ public:
      */
     Q_SLOT void jumpTo(int secs);
 
-    Q_SIGNAL void envImgReady(const cv::Mat &);
-    Q_SIGNAL void purpleImgReady(const cv::Mat &);
-    Q_SIGNAL void yellowImgReady(const cv::Mat &);
-    Q_SIGNAL void sandtrayImgReady(const cv::Mat &);
+    static const float MIN_SPEED;
+    static const float MAX_SPEED;
+
+    /** Sets the playback speed (1 is real time), between MIN_SPEED and MAX_SPEED */
+    Q_SLOT void setSpeed(float speed);
+    /** Doubles the playback speed */
+    Q_SLOT void faster();
+    /** Halves the playback speed */
+    Q_SLOT void slower();
+    Q_SIGNAL void speedChanged(float speed);
+
+    /**
+     * Pauses, and moves 'frames' frames of 'stream' forward (or backward,
+     * if negative), as listed in the bag index.
+     */
+    Q_SLOT void stepFrame(VideoStream stream, int frames);
+
+    // decoded frames, with the wall time at which they were due
+    Q_SIGNAL void envImgReady(const cv::Mat &, ros::WallTime);
+    Q_SIGNAL void purpleImgReady(const cv::Mat &, ros::WallTime);
+    Q_SIGNAL void yellowImgReady(const cv::Mat &, ros::WallTime);
+    Q_SIGNAL void sandtrayImgReady(const cv::Mat &, ros::WallTime);
     Q_SIGNAL void audioFrameReady(const audio_common_msgs::AudioDataConstPtr&);
 
     void loadBag(const std::string& path);
 
+    /**
+     * Sets the on-screen size of a camera stream, so that its frames are
+     * not decoded at a (much) higher resolution than displayed.
+     * Thread-safe.
+     */
+    void setViewerSize(VideoStream stream, cv::Size size) {decoder_.setTargetSize(stream, size);}
+
+    /**
+     * Shows or hides a camera stream: the frames of hidden streams are not
+     * decoded.
+     * Thread-safe.
+     */
+    void setViewerVisible(VideoStream stream, bool visible) {decoder_.setVisible(stream, visible);}
+
+    /**
+     * Sets the priority of the frames of a camera stream over the others
+     * (for instance, for the stream under the mouse).
+     * Thread-safe.
+     */
+    void setViewerPriority(VideoStream stream, TaskPool::Priority priority) {decoder_.setPriority(stream, priority);}
+
+    /**
+     * Records the reading and decoding of the frames in 'stats' (if not
+     * null). To be set before the playback starts.
+     */
+    void setPipelineStats(PipelineStats* stats);
+
     Q_SIGNAL void bagLoaded(ros::Time start, ros::Time end);
 
-    Q_SLOT void processBag();
+    const BagIndex& index() const {return index_;}
+
+    /**
+     * Sets how much of the bag is read ahead of the playback: up to
+     * 'seconds' of bag time, and at most 'megabytes' of memory.
+     * Thread-safe.
+     */
+    void setReadAhead(double seconds, size_t megabytes);
+    BagPrefetcher::Stats prefetchStats() const {return prefetcher_.stats();}
 
-    Q_SIGNAL void durationUpdate(ros::Duration time);
-    Q_SIGNAL void timeUpdate(ros::Time time);
+    /** the current playback time, to be sampled by the GUI */
+    const PlaybackClock& clock() const {return clock_;}
     Q_SLOT void setPlayTime(ros::Time time);
+    /** emitted when the playback jumps to a new position, before it is read */
+    Q_SIGNAL void seeked(ros::Time time);
+
+protected:
+    virtual void timerEvent(QTimerEvent* event) override;
 
 private:
 
+    /**
+     * Restarts reading the bag at begin_. Messages are then played by
+     * playDueMessages(), on m_timer: between messages, and while paused, the
+     * thread is back in its event loop, idle, and control slots (pause,
+     * resume, seek) take effect immediately.
+     */
+    void restart();
+    void resetTimeTranslation(ros::Time time);
+    /** plays all the messages that are due, and schedules the next one */
+    void playDueMessages();
+    void schedule(int msecs);
+    /** whether a camera frame should be dropped, rather than decoded */
+    bool skipFrame(VideoStream stream);
+
     bool running_;
     bool paused_;
-    bool restartProcess_;
+
+    // the next message, read from the prefetcher but not played yet
+    PrefetchedMessage pending_;
+    bool hasPending_;
+    bool reachedEnd_;
     ros::Time bag_begin_, bag_end_;
     ros::Time begin_, end_; // might be different from bag_* if we are playing a subset of the bag
     ros::Time current_;
+    PlaybackClock clock_;
+
+    float time_scale_; // playback speed
 
-    float time_scale_;
+    // wall time at which the last frame of each stream was sent to the decoder
+    std::array<ros::WallTime, NB_VIDEO_STREAMS> lastDecoded_;
 
     rosbag::TimeTranslator time_translator_;
 
+    PipelineStats* stats_;
+
     rosbag::Bag bag_;
 
+    BagIndex index_;
+    BagPrefetcher prefetcher_;
+
+    FrameDecoder decoder_;
+
 };
 
 #endif // BAGREADER_H
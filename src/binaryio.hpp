@@ -0,0 +1,18 @@
+#ifndef BINARYIO_H
+#define BINARYIO_H
+
+#include <istream>
+#include <ostream>
+
+/**
+ * Raw (native endianness) read/write of plain-old-data values, used by the
+ * various cache files written next to the bags.
+ */
+
+template<typename T>
+void writePod(std::ostream& out, const T& value) {out.write(reinterpret_cast<const char*>(&value), sizeof(T));}
+
+template<typename T>
+bool readPod(std::istream& in, T& value) {return static_cast<bool>(in.read(reinterpret_cast<char*>(&value), sizeof(T)));}
+
+#endif // BINARYIO_H
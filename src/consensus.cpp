@@ -0,0 +1,142 @@
+#include <algorithm>
+#include <cassert>
+#include <vector>
+
+#include "consensus.hpp"
+
+using namespace std;
+
+Consensus::Consensus() :
+    nbCoders_(0)
+{
+}
+
+void Consensus::clear()
+{
+    for (auto& track : tracks_) {
+        for (auto& segments : track.segments) segments.clear();
+        track.consensus.clear();
+        track.consensus.takeChanges();
+    }
+    nbCoders_ = 0;
+}
+
+const Annotations& Consensus::annotations(StreamType child) const
+{
+    return tracks_[child == StreamType::YELLOW ? 1 : 0].consensus;
+}
+
+void Consensus::addCoder(const Annotations &purple, const Annotations &yellow)
+{
+    nbCoders_++;
+
+    for (auto child : {StreamType::PURPLE, StreamType::YELLOW}) {
+        auto& track = tracks_[child == StreamType::YELLOW ? 1 : 0];
+        const auto& annotations = (child == StreamType::YELLOW) ? yellow : purple;
+
+        for (auto category : AnnotationCategories) {
+            addVotes(track.segments[static_cast<size_t>(category)], annotations, category);
+        }
+
+        updateConsensus(track);
+    }
+}
+
+void Consensus::split(Segments &segments, ros::Time time)
+{
+    auto next = segments.lower_bound(time);
+    if (next != segments.end() && next->first == time) return;
+
+    // the new segment inherits the votes of the segment it splits (none if it starts before all of them)
+    Votes votes {};
+    if (next != segments.begin()) votes = prev(next)->second;
+    segments.insert(next, {time, votes});
+}
+
+void Consensus::addVotes(Segments &segments, const Annotations &annotations, AnnotationCategory category)
+{
+    // overlapping annotations of a same type are merged first, so that the
+    // coder votes once. Annotations come sorted by start time: one pass suffices.
+    array<vector<pair<ros::Time, ros::Time>>, tuple_size<Votes>::value> intervals;
+    for (const auto& a : annotations) {
+        if (a.start >= a.stop || a.category() != category) continue;
+
+        auto& typeIntervals = intervals[static_cast<size_t>(a.type)];
+        if (!typeIntervals.empty() && a.start <= typeIntervals.back().second) {
+            typeIntervals.back().second = max(typeIntervals.back().second, a.stop);
+        }
+        else {
+            typeIntervals.push_back({a.start, a.stop});
+        }
+    }
+
+    for (size_t type = 0; type < intervals.size(); type++) {
+        for (const auto& interval : intervals[type]) {
+            split(segments, interval.first);
+            split(segments, interval.second);
+
+            for (auto it = segments.find(interval.first); it->first < interval.second; ++it) it->second[type]++;
+        }
+    }
+}
+
+void Consensus::updateConsensus(Track &track) const
+{
+    // the majority threshold depends on the number of coders: every segment
+    // needs to be re-evaluated, in one linear pass over the votes.
+    track.consensus.clear();
+
+    for (auto category : AnnotationCategories) {
+
+        AnnotationType conflict;
+        switch (category) {
+        case AnnotationCategory::TASK_ENGAGEMENT:
+            conflict = AnnotationType::OTHER_TASK_ENGAGEMENT;
+            break;
+        case AnnotationCategory::SOCIAL_ENGAGEMENT:
+            conflict = AnnotationType::OTHER_SOCIAL_ENGAGEMENT;
+            break;
+        case AnnotationCategory::SOCIAL_ATTITUDE:
+            conflict = AnnotationType::OTHER_SOCIAL_ATTITUDE;
+            break;
+        default:
+            assert(false);
+            conflict = AnnotationType::OTHER;
+            break;
+        }
+
+        const auto& segments = track.segments[static_cast<size_t>(category)];
+
+        // consecutive identical segments are merged
+        Annotation pending(AnnotationType::MISSING, ros::TIME_MIN, ros::TIME_MIN);
+
+        for (auto it = segments.begin(); it != segments.end() && next(it) != segments.end(); ++it) {
+            const auto& votes = it->second;
+
+            size_t best = 0;
+            uint16_t total = 0;
+            for (size_t t = 0; t < votes.size(); t++) {
+                total += votes[t];
+                if (votes[t] > votes[best]) best = t;
+            }
+            if (total == 0) continue;
+
+            Annotation a = (votes[best] * 2 > nbCoders_)
+                                ? Annotation(static_cast<AnnotationType>(best), it->first, next(it)->first)
+                                : Annotation(conflict, it->first, next(it)->first, true);
+
+            if (   pending.type == a.type
+                && pending.isConflicted == a.isConflicted
+                && pending.stop == a.start) {
+                pending.stop = a.stop;
+            }
+            else {
+                if (pending.type != AnnotationType::MISSING) track.consensus.append(pending);
+                pending = a;
+            }
+        }
+        if (pending.type != AnnotationType::MISSING) track.consensus.append(pending);
+    }
+
+    track.consensus.takeChanges();
+}
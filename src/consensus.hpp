@@ -0,0 +1,60 @@
+#ifndef CONSENSUS_H
+#define CONSENSUS_H
+
+#include <array>
+#include <map>
+
+#include <ros/time.h>
+
+#include "annotation.hpp"
+
+/**
+ * Majority-vote consensus of the annotations of several coders, per child
+ * and per category.
+ *
+ * Time is split into elementary segments at every start and stop time of
+ * every coder's annotations, and each segment counts the coders' votes for
+ * each annotation type. Adding a coder only splits the segments at its own
+ * boundaries and increments the votes of the segments its annotations
+ * cover: the annotations of the previous coders are never revisited.
+ * Overlapping annotations of one coder only count as one vote.
+ *
+ * A segment gets the annotation type chosen by a strict majority of the
+ * coders. Otherwise, it is marked as conflicted.
+ */
+class Consensus
+{
+public:
+
+    Consensus();
+
+    void clear();
+
+    void addCoder(const Annotations& purple, const Annotations& yellow);
+
+    size_t nbCoders() const {return nbCoders_;}
+
+    /** Returns the consensus annotations of one child (PURPLE or YELLOW) */
+    const Annotations& annotations(StreamType child) const;
+
+private:
+
+    typedef std::array<uint16_t, static_cast<size_t>(AnnotationType::MISSING)> Votes;
+    // each segment starts at its key, and lasts until the next one
+    typedef std::map<ros::Time, Votes> Segments;
+
+    struct Track {
+        std::array<Segments, 4> segments; // per category
+        Annotations consensus;
+    };
+
+    static void split(Segments& segments, ros::Time time);
+    /** Adds one coder's votes for the annotations of 'category' */
+    static void addVotes(Segments& segments, const Annotations& annotations, AnnotationCategory category);
+    void updateConsensus(Track& track) const;
+
+    std::array<Track, 2> tracks_; // purple, yellow
+    size_t nbCoders_;
+};
+
+#endif // CONSENSUS_H
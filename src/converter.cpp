@@ -1,58 +1,118 @@
 
 #include <QImage>
-#include <QTimerEvent>
 
 #include <QDebug>
 
 #include "converter.hpp"
+#include "pipelinestats.hpp"
+#include "pixelkernels.hpp"
 
 
 
-void rotate(const cv::Mat& image, cv::Mat& dest, RotateCode rotation)
+// number of clockwise quarter turns of each rotation
+static int quarterTurns(RotateCode rotation)
 {
     switch (rotation) {
-        case ROTATE_90_CLOCKWISE:
-            cv::flip(image.t(), dest, 1);
-            break;
-        case ROTATE_180:
-            cv::flip(image, dest, -1);
-            break;
-        case ROTATE_90_COUNTERCLOCKWISE:
-            cv::flip(image.t(), dest, 0);
-            break;
+        case ROTATE_90_CLOCKWISE: return 1;
+        case ROTATE_180: return 2;
+        case ROTATE_90_COUNTERCLOCKWISE: return 3;
     }
+    return 0;
 }
 
-void Converter::matDeleter(void *mat) { delete static_cast<cv::Mat*>(mat); }
+// the QImage holds a reference on the buffer of the cv::Mat it wraps, released
+// like cv::Mat::release() would: pooled buffers then go back to their pool
+void Converter::matDeleter(void *data) {
+    auto u = static_cast<cv::UMatData*>(data);
+    if (CV_XADD(&u->refcount, -1) == 1) u->currAllocator->unmap(u);
+}
+
+void Converter::convertNext() {
+    Frame frame;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (pending_.empty()) { // cleared on destruction
+            busy_ = false;
+            idle_.notify_all();
+            return;
+        }
+        frame = pending_.front();
+        pending_.pop_front();
+    }
 
-void Converter::queue(const cv::Mat &frame) {
-    if (!m_frame.empty()) qDebug() << "Converter dropped frame!";
-    m_frame = frame;
-    if (! m_timer.isActive()) m_timer.start(0, this);
+    process(frame);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (pending_.empty()) {
+        busy_ = false;
+        idle_.notify_all();
+    }
+    // resubmitted rather than looping, so that higher priority tasks run first
+    else pool_.submit([this]{convertNext();}, priority_);
 }
 
-void Converter::process(cv::Mat frame) {
+void Converter::process(const Frame& input) {
+    auto start = ros::WallTime::now();
+    const auto& frame = input.image;
     //cv::resize(frame, frame, cv::Size(), 0.3, 0.3, cv::INTER_AREA);
-    // if (rotate_) cv::rotate(frame,frame,rotateCode_); // OpencV3.2 only
-    if (rotate_) rotate(frame,frame,rotateCode_);
-    cv::cvtColor(frame, frame, CV_BGR2RGB);
-    const QImage image(frame.data, frame.cols, frame.rows, frame.step,
-                       QImage::Format_RGB888, &matDeleter, new cv::Mat(frame));
-    Q_ASSERT(image.constBits() == frame.data);
-    emit imageReady(image);
+    Q_ASSERT(frame.type() == CV_8UC3);
+
+    int turns = rotate_ ? quarterTurns(rotateCode_) : 0;
+
+    cv::Mat rgb;
+    if (turns == 0 && DECODED_FRAMES_ARE_RGB) {
+        // already displayable: wrapped as is, without any pass over the pixels
+        rgb = frame;
+    }
+    else {
+        // rotation and, if needed, BGR -> RGB conversion, in a single pass,
+        // into a buffer of the same pool as the decoded frame
+        rgb.allocator = frame.allocator;
+        rgb.create(turns % 2 ? frame.cols : frame.rows,
+                   turns % 2 ? frame.rows : frame.cols,
+                   CV_8UC3);
+        rotatePixels(frame.data, frame.cols, frame.rows, frame.step, rgb.data, rgb.step,
+                     turns, !DECODED_FRAMES_ARE_RGB);
+    }
+
+    Q_ASSERT(rgb.u && rgb.data == rgb.u->data);
+    CV_XADD(&rgb.u->refcount, 1);
+    const QImage image(rgb.data, rgb.cols, rgb.rows, rgb.step,
+                       QImage::Format_RGB888, &matDeleter, rgb.u);
+    Q_ASSERT(image.constBits() == rgb.data);
+
+    if (stats_) stats_->record(stream_, PipelineStats::Stage::CONVERT, ros::WallTime::now() - start);
+    emit imageReady(image, input.due);
+}
+
+Converter::Converter(TaskPool &pool, QObject *parent) : QObject(parent), pool_(pool), rotate_(false) {}
+
+Converter::~Converter() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    pending_.clear();
+    idle_.wait(lock, [this]{return !busy_;});
 }
 
-void Converter::timerEvent(QTimerEvent *ev) {
-    if (ev->timerId() != m_timer.timerId()) return;
-    process(m_frame);
-    m_frame.release();
-    m_timer.stop();
+void Converter::setProcessAll(bool all) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    processAll_ = all;
 }
 
-Converter::Converter(QObject *parent) : QObject(parent), rotate_(false) {}
+void Converter::setPriority(TaskPool::Priority priority) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    priority_ = priority;
+}
 
-void Converter::setProcessAll(bool all) { m_processAll = all; }
+void Converter::processFrame(const cv::Mat &frame, ros::WallTime due) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!processAll_ && !pending_.empty()) {
+        if (stats_) stats_->dropped(stream_, PipelineStats::Stage::CONVERT);
+        pending_.clear();
+    }
+    pending_.push_back({frame, due});
 
-void Converter::processFrame(const cv::Mat &frame) {
-    if (m_processAll) process(frame); else queue(frame);
+    if (!busy_) {
+        busy_ = true;
+        pool_.submit([this]{convertNext();}, priority_);
+    }
 }
@@ -1,36 +1,69 @@
 #ifndef CONVERTER_H
 #define CONVERTER_H
 
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
 #include <opencv2/opencv.hpp>
 #include <QObject>
-#include <QBasicTimer>
+#include <ros/time.h>
+
+#include "framedecoder.hpp"
+#include "taskpool.hpp"
 
 enum RotateCode {ROTATE_90_CLOCKWISE, ROTATE_180, ROTATE_90_COUNTERCLOCKWISE};
 
+/**
+ * Converts the decoded frames of a stream into QImages, on a TaskPool.
+ *
+ * At most one frame of a stream is converted at a time, so that images are
+ * emitted in order. Unless all frames are processed (setProcessAll), a frame
+ * arriving while another one is being converted replaces any frame still
+ * waiting: the viewer only gets the latest one.
+ */
 class Converter : public QObject {
     Q_OBJECT
 
-    QBasicTimer m_timer;
-    cv::Mat m_frame;
-    bool m_processAll = true;
+    TaskPool& pool_;
+
+    std::mutex mutex_;
+    std::condition_variable idle_;
+    struct Frame {
+        cv::Mat image;
+        ros::WallTime due;
+    };
+
+    std::deque<Frame> pending_;
+    bool busy_ = false; // a conversion task is queued or running
+    bool processAll_ = true;
+    TaskPool::Priority priority_ = TaskPool::Priority::NORMAL;
 
-    static void matDeleter(void* mat);
+    PipelineStats* stats_ = nullptr;
+    VideoStream stream_ = VideoStream::ENV;
 
-    void queue(const cv::Mat & frame);
+    static void matDeleter(void* data);
 
-    void process(cv::Mat frame);
+    /** converts the next pending frame, then resubmits itself if needed */
+    void convertNext();
 
-    void timerEvent(QTimerEvent * ev);
+    void process(const Frame& frame);
 
     bool rotate_;
     RotateCode rotateCode_;
 
 public:
-    explicit Converter(QObject * parent = nullptr);
+    explicit Converter(TaskPool & pool, QObject * parent = nullptr);
+    ~Converter();
     void setProcessAll(bool all);
+    void setPriority(TaskPool::Priority priority);
+    /** records the conversion times and drops of 'stream' in 'stats'; to be set before any frame */
+    void setStats(PipelineStats * stats, VideoStream stream) {stats_ = stats; stream_ = stream;}
     void applyRotation(RotateCode rotateCode) {rotate_=true; rotateCode_=rotateCode;}
-    Q_SIGNAL void imageReady(const QImage &);
-    Q_SLOT void processFrame(const cv::Mat & frame);
+    /** 'due' is the wall time at which the frame was due */
+    Q_SIGNAL void imageReady(const QImage &, ros::WallTime due);
+    /** thread-safe: can be directly connected to the decoder */
+    Q_SLOT void processFrame(const cv::Mat & frame, ros::WallTime due);
 };
 
 
@@ -0,0 +1,276 @@
+#include <QDebug>
+
+#ifdef HAVE_TURBOJPEG
+#include <turbojpeg.h>
+#endif
+
+#include "framedecoder.hpp"
+#include "framepool.hpp"
+#include "pipelinestats.hpp"
+
+using namespace std;
+
+/**
+ * The frame buffers of each stream. They are process-wide, as decoded
+ * frames may outlive the decoder (queued to the converters, or shown by
+ * the viewers).
+ */
+static FramePool& framePool(VideoStream stream)
+{
+    static array<FramePool, NB_VIDEO_STREAMS> pools;
+    return pools[static_cast<size_t>(stream)];
+}
+
+#ifdef HAVE_TURBOJPEG
+
+/** a libjpeg-turbo decompressor, owned by a single thread */
+struct TurboDecompressor {
+    tjhandle handle;
+
+    TurboDecompressor() : handle(tjInitDecompress()) {}
+    ~TurboDecompressor() {if (handle) tjDestroy(handle);}
+};
+
+/**
+ * Decodes a JPEG image straight to RGB, reduced by 'scale' (1, 2, 4 or 8),
+ * into a buffer of 'pool'. Returns an empty image on failure.
+ */
+static cv::Mat decodeJpegRGB(const vector<uint8_t>& data, int scale, FramePool& pool)
+{
+    // decompressors are not thread-safe, and cheap enough to keep one per worker
+    static thread_local TurboDecompressor decompressor;
+    if (!decompressor.handle) return {};
+
+    auto jpeg = const_cast<unsigned char*>(data.data());
+
+    int width, height, subsampling, colorspace;
+    if (tjDecompressHeader3(decompressor.handle, jpeg, data.size(),
+                            &width, &height, &subsampling, &colorspace) != 0) return {};
+
+    tjscalingfactor factor = {1, scale};
+    cv::Mat frame;
+    frame.allocator = &pool;
+    frame.create(TJSCALED(height, factor), TJSCALED(width, factor), CV_8UC3);
+
+    if (tjDecompress2(decompressor.handle, jpeg, data.size(),
+                      frame.data, frame.cols, frame.step, frame.rows,
+                      TJPF_RGB, TJFLAG_FASTDCT) != 0) {
+        qWarning() << "Unable to decode frame:" << tjGetErrorStr();
+        return {};
+    }
+    return frame;
+}
+
+#endif
+
+/**
+ * Reads the size of a JPEG image from its SOF header, without decoding it.
+ * Returns an empty size if 'data' is not a JPEG image.
+ */
+cv::Size jpegSize(const vector<uint8_t>& data)
+{
+    if (data.size() < 4 || data[0] != 0xFF || data[1] != 0xD8) return {};
+
+    size_t i = 2;
+    while (i + 9 <= data.size()) {
+        if (data[i] != 0xFF) return {};
+
+        uint8_t marker = data[i+1];
+        if (marker == 0xFF) {i++; continue;} // fill byte
+
+        // SOFn markers, except DHT (C4), JPG (C8) and DAC (CC)
+        if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+            int height = (data[i+5] << 8) | data[i+6];
+            int width = (data[i+7] << 8) | data[i+8];
+            return cv::Size(width, height);
+        }
+
+        size_t len = (data[i+2] << 8) | data[i+3];
+        i += 2 + len;
+    }
+    return {};
+}
+
+/**
+ * Returns the largest DCT scale (1, 2, 4 or 8) at which an image of size
+ * 'source' still covers 'target' once fitted in it (aspect ratio kept).
+ */
+int reductionFor(cv::Size source, cv::Size target)
+{
+    if (source.area() == 0 || target.area() == 0) return 1;
+
+    double ratio = min(double(target.width) / source.width, double(target.height) / source.height);
+
+    int scale = 1;
+    while (scale < 8 && ratio * scale * 2 <= 1.) scale *= 2;
+    return scale;
+}
+
+FrameDecoder::FrameDecoder(TaskPool &pool, FrameCallback callback) :
+    pool_(pool),
+    callback_(callback),
+    stats_(nullptr),
+    maxInFlight_(pool.size() + 1),
+    running_(0)
+{
+}
+
+FrameDecoder::~FrameDecoder()
+{
+    unique_lock<mutex> lock(runningMutex_);
+    idle_.wait(lock, [this]{return running_ == 0;});
+}
+
+bool FrameDecoder::decode(VideoStream stream, sensor_msgs::CompressedImageConstPtr msg)
+{
+    auto& queue = queues_[static_cast<size_t>(stream)];
+
+    uint64_t seq;
+    TaskPool::Priority priority;
+    {
+        lock_guard<mutex> lock(queue.mutex);
+        if (!queue.visible) {
+            queue.last = msg;
+            return true;
+        }
+        if (queue.nextIn - queue.nextOut >= maxInFlight_) {
+            if (stats_) stats_->dropped(stream, PipelineStats::Stage::DECODE);
+            return false;
+        }
+        seq = queue.nextIn++;
+        queue.last = msg;
+        priority = queue.priority;
+    }
+
+    {
+        lock_guard<mutex> lock(runningMutex_);
+        running_++;
+    }
+
+    auto due = ros::WallTime::now();
+
+    pool_.submit([this, stream, seq, msg, due]() {
+        auto start = ros::WallTime::now();
+        DecodedFrame decoded = {cv::Mat(), due};
+        // a corrupted frame is delivered empty (ie skipped): later frames must not wait for it
+        try {
+            decoded.frame = decodeFrame(stream, *msg);
+        }
+        catch (const std::exception& e) {
+            qWarning() << "Unable to decode a frame:" << e.what();
+        }
+        if (stats_ && !decoded.frame.empty()) stats_->record(stream, PipelineStats::Stage::DECODE, ros::WallTime::now() - start);
+
+        deliver(stream, seq, decoded);
+
+        lock_guard<mutex> lock(runningMutex_);
+        if (--running_ == 0) idle_.notify_all();
+    }, priority);
+
+    return true;
+}
+
+void FrameDecoder::flush()
+{
+    for (auto& queue : queues_) {
+        lock_guard<mutex> lock(queue.mutex);
+        queue.nextOut = queue.nextIn;
+        queue.decoded.clear();
+        // nor decoded again by setTargetSize() or setVisible(): it predates the seek
+        queue.last.reset();
+    }
+}
+
+void FrameDecoder::setTargetSize(VideoStream stream, cv::Size size)
+{
+    auto& queue = queues_[static_cast<size_t>(stream)];
+
+    sensor_msgs::CompressedImageConstPtr redecode;
+    {
+        lock_guard<mutex> lock(queue.mutex);
+        queue.target = size;
+        if (queue.last && reductionFor(queue.source, size) < queue.lastScale) redecode = queue.last;
+    }
+
+    if (redecode) decode(stream, redecode);
+}
+
+void FrameDecoder::setVisible(VideoStream stream, bool visible)
+{
+    auto& queue = queues_[static_cast<size_t>(stream)];
+
+    sensor_msgs::CompressedImageConstPtr redecode;
+    {
+        lock_guard<mutex> lock(queue.mutex);
+        if (visible && !queue.visible) redecode = queue.last;
+        queue.visible = visible;
+    }
+
+    if (redecode) decode(stream, redecode);
+}
+
+void FrameDecoder::setPriority(VideoStream stream, TaskPool::Priority priority)
+{
+    auto& queue = queues_[static_cast<size_t>(stream)];
+
+    lock_guard<mutex> lock(queue.mutex);
+    queue.priority = priority;
+}
+
+cv::Mat FrameDecoder::decodeFrame(VideoStream stream, const sensor_msgs::CompressedImage &msg)
+{
+    auto& queue = queues_[static_cast<size_t>(stream)];
+
+    auto source = jpegSize(msg.data);
+    int scale;
+    {
+        lock_guard<mutex> lock(queue.mutex);
+        if (source.area() > 0) queue.source = source;
+        scale = reductionFor(source, queue.target);
+        queue.lastScale = scale;
+    }
+
+#ifdef HAVE_TURBOJPEG
+    if (source.area() > 0) {
+        auto frame = decodeJpegRGB(msg.data, scale, framePool(stream));
+        if (!frame.empty()) return frame;
+    }
+#endif
+
+    int flags = cv::IMREAD_COLOR;
+    switch (scale) {
+    case 2: flags = cv::IMREAD_REDUCED_COLOR_2; break;
+    case 4: flags = cv::IMREAD_REDUCED_COLOR_4; break;
+    case 8: flags = cv::IMREAD_REDUCED_COLOR_8; break;
+    }
+
+    // imdecode creates its output through the allocator of 'frame'
+    cv::Mat frame;
+    frame.allocator = &framePool(stream);
+    cv::imdecode(msg.data, flags, &frame);
+
+    // only for frames libjpeg-turbo could not decode
+    if (DECODED_FRAMES_ARE_RGB && !frame.empty()) cv::cvtColor(frame, frame, cv::COLOR_BGR2RGB);
+
+    return frame;
+}
+
+void FrameDecoder::deliver(VideoStream stream, uint64_t seq, DecodedFrame frame)
+{
+    auto& queue = queues_[static_cast<size_t>(stream)];
+
+    // the lock is held while calling back, so that frames are delivered
+    // in order even when they are decoded by different workers
+    lock_guard<mutex> lock(queue.mutex);
+
+    if (seq < queue.nextOut) return; // flushed
+
+    queue.decoded[seq] = frame;
+
+    while (!queue.decoded.empty() && queue.decoded.begin()->first == queue.nextOut) {
+        auto next = queue.decoded.begin();
+        if (!next->second.frame.empty()) callback_(stream, next->second.frame, next->second.due);
+        queue.decoded.erase(next);
+        queue.nextOut++;
+    }
+}
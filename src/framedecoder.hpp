@@ -0,0 +1,128 @@
+#ifndef FRAMEDECODER_H
+#define FRAMEDECODER_H
+
+#include <array>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+
+#include <opencv2/opencv.hpp>
+#include <ros/time.h>
+#include <sensor_msgs/CompressedImage.h>
+
+#include "taskpool.hpp"
+
+enum class VideoStream {ENV=0, PURPLE, YELLOW, SANDTRAY};
+const size_t NB_VIDEO_STREAMS = 4;
+
+class PipelineStats;
+
+/**
+ * Channel order of the decoded frames. With libjpeg-turbo, JPEG frames are
+ * decoded straight to RGB; otherwise, they come out of OpenCV as BGR and
+ * the channels are swapped later, while converting them for display.
+ */
+#ifdef HAVE_TURBOJPEG
+const bool DECODED_FRAMES_ARE_RGB = true;
+#else
+const bool DECODED_FRAMES_ARE_RGB = false;
+#endif
+
+/**
+ * Decodes the compressed camera frames on a TaskPool.
+ *
+ * Frames of a given stream can be decoded concurrently, but they are
+ * always delivered in the order they were submitted (one ordered output
+ * queue per stream). The delivery callback is called from the pool's
+ * threads.
+ *
+ * If the size at which a stream is displayed is known (setTargetSize), JPEG
+ * frames are decoded at the smallest DCT scale (1, 1/2, 1/4 or 1/8) that
+ * still covers it. The frames of hidden streams are not decoded at all, and
+ * the frames of a stream can be decoded in priority over the others.
+ *
+ * Frames are delivered as 8-bit, 3-channel images, in the channel order
+ * given by DECODED_FRAMES_ARE_RGB, along with the wall time at which they
+ * were submitted (that is, when they were due).
+ */
+class FrameDecoder
+{
+public:
+
+    typedef std::function<void(VideoStream, const cv::Mat&, ros::WallTime)> FrameCallback;
+
+    FrameDecoder(TaskPool& pool, FrameCallback callback);
+    ~FrameDecoder();
+
+    /**
+     * Queues a frame for decoding.
+     * If the stream already has too many frames in flight, the frame is
+     * dropped and false is returned. If the stream is hidden, the frame is
+     * only kept, to be decoded once the stream is shown again.
+     */
+    bool decode(VideoStream stream, sensor_msgs::CompressedImageConstPtr msg);
+
+    /**
+     * Drops the frames currently in flight (for instance, after a seek):
+     * they will not be delivered, nor decoded again later.
+     */
+    void flush();
+
+    /**
+     * Sets the on-screen size of 'stream'. If the last frame was decoded at
+     * a resolution too low for the new size, it is decoded again.
+     */
+    void setTargetSize(VideoStream stream, cv::Size size);
+
+    /**
+     * Shows or hides 'stream'. Once shown again, its last frame is decoded
+     * straight away.
+     */
+    void setVisible(VideoStream stream, bool visible);
+
+    /** Sets the priority of the decoding tasks of 'stream' */
+    void setPriority(VideoStream stream, TaskPool::Priority priority);
+
+    /** Records the decoding times and drops in 'stats' (if not null) */
+    void setStats(PipelineStats* stats) {stats_ = stats;}
+
+private:
+
+    struct DecodedFrame {
+        cv::Mat frame;
+        ros::WallTime due;
+    };
+
+    struct OutputQueue {
+        std::mutex mutex;
+        uint64_t nextIn = 0;   // sequence number of the next submitted frame
+        uint64_t nextOut = 0;  // sequence number of the next frame to deliver
+        std::map<uint64_t, DecodedFrame> decoded; // decoded, but waiting for an earlier frame
+
+        cv::Size target;       // on-screen size (empty if unknown)
+        cv::Size source;       // full resolution of the stream
+        int lastScale = 1;     // DCT scale the last frame was decoded at
+        sensor_msgs::CompressedImageConstPtr last;
+
+        bool visible = true;
+        TaskPool::Priority priority = TaskPool::Priority::NORMAL;
+    };
+
+    cv::Mat decodeFrame(VideoStream stream, const sensor_msgs::CompressedImage& msg);
+    void deliver(VideoStream stream, uint64_t seq, DecodedFrame frame);
+
+    TaskPool& pool_;
+    FrameCallback callback_;
+    PipelineStats* stats_;
+
+    size_t maxInFlight_;
+    std::array<OutputQueue, NB_VIDEO_STREAMS> queues_;
+
+    // used to wait for the tasks still running on destruction
+    std::mutex runningMutex_;
+    std::condition_variable idle_;
+    size_t running_;
+};
+
+#endif // FRAMEDECODER_H
@@ -0,0 +1,79 @@
+#include <algorithm>
+
+#include "framepool.hpp"
+
+using namespace std;
+
+const size_t FramePool::MAX_FREE = 8;
+
+FramePool::~FramePool()
+{
+    for (auto& buffer : free_) cv::fastFree(buffer.second);
+}
+
+cv::UMatData* FramePool::allocate(int dims, const int* sizes, int type,
+                                  void* data, size_t* step, int /*flags*/,
+                                  cv::UMatUsageFlags /*usageFlags*/) const
+{
+    // same layout as OpenCV's default allocator: densely packed rows
+    size_t total = CV_ELEM_SIZE(type);
+    for (int i = dims - 1; i >= 0; i--) {
+        if (step) {
+            if (data && step[i] != CV_AUTOSTEP) {
+                CV_Assert(total <= step[i]);
+                total = step[i];
+            }
+            else step[i] = total;
+        }
+        total *= sizes[i];
+    }
+
+    auto u = new cv::UMatData(this);
+    u->size = total;
+
+    if (data) {
+        u->data = u->origdata = static_cast<uchar*>(data);
+        u->flags |= cv::UMatData::USER_ALLOCATED;
+        return u;
+    }
+
+    uchar* buffer = nullptr;
+    {
+        lock_guard<mutex> lock(mutex_);
+        auto it = find_if(free_.rbegin(), free_.rend(),
+                          [total](const pair<size_t, uchar*>& b) {return b.first == total;});
+        if (it != free_.rend()) {
+            buffer = it->second;
+            free_.erase(next(it).base());
+        }
+    }
+    if (!buffer) buffer = static_cast<uchar*>(cv::fastMalloc(total));
+
+    u->data = u->origdata = buffer;
+    return u;
+}
+
+bool FramePool::allocate(cv::UMatData *u, int /*accessFlags*/, cv::UMatUsageFlags /*usageFlags*/) const
+{
+    return u != nullptr;
+}
+
+void FramePool::deallocate(cv::UMatData *u) const
+{
+    if (!u) return;
+    CV_Assert(u->urefcount == 0 && u->refcount == 0);
+
+    if (!(u->flags & cv::UMatData::USER_ALLOCATED)) {
+        uchar* evicted = nullptr;
+        {
+            lock_guard<mutex> lock(mutex_);
+            free_.emplace_back(u->size, u->origdata);
+            if (free_.size() > MAX_FREE) {
+                evicted = free_.front().second;
+                free_.erase(free_.begin());
+            }
+        }
+        cv::fastFree(evicted);
+    }
+    delete u;
+}
@@ -0,0 +1,49 @@
+#ifndef FRAMEPOOL_H
+#define FRAMEPOOL_H
+
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+/**
+ * A cv::MatAllocator that recycles the pixel buffers of the frames.
+ *
+ * Set as the allocator of a cv::Mat, buffers are taken from the pool when
+ * the matrix is created, and given back to it (instead of freed) once the
+ * last reference to the matrix is released, wherever that happens. Since
+ * the frames of a stream all have the same size, steady-state playback
+ * keeps reusing the same few buffers.
+ *
+ * At most MAX_FREE buffers are kept aside; the oldest ones are freed first,
+ * so that buffers of a size no longer in use (for instance, after the
+ * decoding scale changed) do not linger.
+ *
+ * Thread-safe. The pool must outlive every matrix allocated from it.
+ */
+class FramePool : public cv::MatAllocator
+{
+public:
+
+    static const size_t MAX_FREE;
+
+    FramePool() = default;
+    ~FramePool();
+
+    FramePool(const FramePool&) = delete;
+    FramePool& operator=(const FramePool&) = delete;
+
+    cv::UMatData* allocate(int dims, const int* sizes, int type,
+                           void* data, size_t* step, int flags,
+                           cv::UMatUsageFlags usageFlags) const override;
+    bool allocate(cv::UMatData* u, int accessFlags, cv::UMatUsageFlags usageFlags) const override;
+    void deallocate(cv::UMatData* u) const override;
+
+private:
+
+    mutable std::mutex mutex_;
+    mutable std::vector<std::pair<size_t, uchar*>> free_; // (size, buffer), oldest first
+};
+
+#endif // FRAMEPOOL_H
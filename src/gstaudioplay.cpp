@@ -28,8 +28,21 @@ GstAudioPlay::GstAudioPlay()
     _convert = gst_element_factory_make("audioconvert", "convert");
     audiopad = gst_element_get_static_pad(_convert, "sink");
     _sink = gst_element_factory_make("autoaudiosink", "sink");
-    gst_bin_add_many( GST_BIN(_audio), _convert, _sink, NULL);
-    gst_element_link(_convert, _sink);
+
+    // changes the tempo of the audio when playing faster or slower than real time
+    _tempo = gst_element_factory_make("pitch", "tempo");
+    if (_tempo) {
+        _convertOut = gst_element_factory_make("audioconvert", "convert_out");
+        gst_bin_add_many( GST_BIN(_audio), _convert, _tempo, _convertOut, _sink, NULL);
+        gst_element_link_many(_convert, _tempo, _convertOut, _sink, NULL);
+    }
+    else {
+        qWarning() << "GStreamer 'pitch' element not found: audio is muted when not playing in real time";
+        _convertOut = nullptr;
+        gst_bin_add_many( GST_BIN(_audio), _convert, _sink, NULL);
+        gst_element_link(_convert, _sink);
+    }
+    _tempoValue = 1.f;
     gst_element_add_pad(_audio, gst_ghost_pad_new("sink", audiopad));
     gst_object_unref(audiopad);
 
@@ -44,8 +57,17 @@ GstAudioPlay::GstAudioPlay()
     _paused = false;
 }
 
+void GstAudioPlay::setTempo(float tempo)
+{
+    _tempoValue = tempo;
+    if (_tempo) g_object_set(G_OBJECT(_tempo), "tempo", tempo, NULL);
+}
+
 void GstAudioPlay::audioMsgReady(const audio_common_msgs::AudioDataConstPtr &msg)
 {
+    // the chunks would arrive faster (or slower) than they are played
+    if (!_tempo && _tempoValue != 1.f) return;
+
     if(_paused)
     {
         gst_element_set_state(GST_ELEMENT(_pipeline), GST_STATE_PLAYING);
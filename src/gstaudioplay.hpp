@@ -18,6 +18,13 @@ public:
     GstAudioPlay();
 
     Q_SLOT void audioMsgReady(const audio_common_msgs::AudioDataConstPtr &msg);
+
+    /**
+     * Sets the playback tempo (1 is real time), preserving the pitch.
+     * Requires the 'pitch' element (soundtouch): without it, the audio is
+     * muted when the tempo differs from 1.
+     */
+    Q_SLOT void setTempo(float tempo);
 private:
 
 
@@ -31,6 +38,8 @@ private:
     std::thread _gst_thread;
 
     GstElement *_pipeline, *_source, *_sink, *_decoder, *_convert, *_audio;
+    GstElement *_tempo, *_convertOut;
+    float _tempoValue;
     GstElement *_playbin;
     GMainLoop *_loop;
 
@@ -1,25 +1,59 @@
 #include <QPainter>
+#include <QResizeEvent>
 #include <QDebug>
 
 #include "imageviewer.hpp"
+#include "pipelinestats.hpp"
 
 void ImageViewer::paintEvent(QPaintEvent *) {
     QPainter p(this);
 
     if(!m_img.isNull()) {
-        p.drawImage(0, 0, m_img.scaled(size(), Qt::KeepAspectRatio));
+        auto start = ros::WallTime::now();
+
+        // scaled while drawing, rather than through a scaled() copy of the frame
+        auto target = m_img.size().scaled(size(), Qt::KeepAspectRatio);
+        p.drawImage(QRect(QPoint(0, 0), target), m_img);
+
+        if (m_stats && !m_due.isZero()) {
+            m_stats->record(m_stream, PipelineStats::Stage::PAINT, ros::WallTime::now() - start);
+            m_stats->displayed(m_stream, m_due);
+        }
     }
 
+    // gives the frame buffer back to its pool
     m_img = {};
 }
 
+void ImageViewer::resizeEvent(QResizeEvent *ev) {
+    emit resized(ev->size() * devicePixelRatio());
+    updateShown();
+}
+
+void ImageViewer::showEvent(QShowEvent *) { updateShown(); }
+
+void ImageViewer::hideEvent(QHideEvent *) { updateShown(); }
+
+void ImageViewer::enterEvent(QEvent *) { emit hoveredChanged(true); }
+
+void ImageViewer::leaveEvent(QEvent *) { emit hoveredChanged(false); }
+
+void ImageViewer::updateShown() {
+    bool shown = isVisible() && !size().isEmpty();
+    if (shown == m_shown) return;
+    m_shown = shown;
+    emit shownChanged(shown);
+}
+
 ImageViewer::ImageViewer(QWidget *parent) : QWidget(parent) {
     setAttribute(Qt::WA_OpaquePaintEvent);
 }
 
-void ImageViewer::setImage(const QImage &img) {
-    if (!m_img.isNull()) qDebug() << "Viewer dropped frame!";
+void ImageViewer::setImage(const QImage &img, ros::WallTime due) {
+    // the previous image was never painted
+    if (!m_img.isNull() && m_stats && !m_due.isZero()) m_stats->dropped(m_stream, PipelineStats::Stage::PAINT);
     m_img = img;
+    m_due = due;
     if (m_img.size() != size()) {
         //setFixedSize(m_img.size());
     }
@@ -2,14 +2,39 @@
 #define IMAGEVIEWER_H
 
 #include <QWidget>
+#include <ros/time.h>
+
+#include "framedecoder.hpp"
 
 class ImageViewer : public QWidget {
     Q_OBJECT
     QImage m_img;
+    ros::WallTime m_due; // of the frame in m_img; zero for other images (thumbnails)
+    bool m_shown = false;
+    PipelineStats * m_stats = nullptr;
+    VideoStream m_stream = VideoStream::ENV;
     void paintEvent(QPaintEvent *);
+    void resizeEvent(QResizeEvent *);
+    void showEvent(QShowEvent *);
+    void hideEvent(QHideEvent *);
+    void enterEvent(QEvent *);
+    void leaveEvent(QEvent *);
+    void updateShown();
 public:
     ImageViewer(QWidget * parent = nullptr);
-    Q_SLOT void setImage(const QImage & img);
+    /**
+     * Shows 'img' at the next repaint. For the frames of the video pipeline,
+     * 'due' is the wall time at which they were due.
+     */
+    Q_SLOT void setImage(const QImage & img, ros::WallTime due = ros::WallTime());
+    /** records the painting times, drops and latencies of 'stream' in 'stats' */
+    void setStats(PipelineStats * stats, VideoStream stream) {m_stats = stats; m_stream = stream;}
+    /** emitted with the on-screen size of the viewer, in device pixels */
+    Q_SIGNAL void resized(const QSize & size);
+    /** emitted when the viewer is shown or hidden (or collapsed to an empty size) */
+    Q_SIGNAL void shownChanged(bool shown);
+    /** emitted when the mouse enters or leaves the viewer */
+    Q_SIGNAL void hoveredChanged(bool hovered);
 };
 
 
@@ -1,5 +1,7 @@
 // https://github.com/KubaO/stackoverflown/tree/master/questions/opencv-21246766
+#include <atomic>
 #include <memory>
+#include <tuple>
 
 #include <QtWidgets>
 #include <QTimer>
@@ -17,6 +19,10 @@
 #include "converter.hpp"
 #include "timeline.hpp"
 #include "gstaudioplay.hpp"
+#include "thumbnailcache.hpp"
+#include "audiowaveform.hpp"
+#include "pipelinestats.hpp"
+#include "taskpool.hpp"
 
 #include "ajaxhandler.hpp"
 #include "http_server/server.hpp"
@@ -24,6 +30,7 @@
 Q_DECLARE_METATYPE(cv::Mat)
 Q_DECLARE_METATYPE(ros::Time)
 Q_DECLARE_METATYPE(ros::Duration)
+Q_DECLARE_METATYPE(ros::WallTime)
 Q_DECLARE_METATYPE(audio_common_msgs::AudioDataConstPtr)
 
 using namespace std;
@@ -35,6 +42,7 @@ int main(int argc, char *argv[])
     qRegisterMetaType<cv::Mat>();
     qRegisterMetaType<ros::Time>();
     qRegisterMetaType<ros::Duration>();
+    qRegisterMetaType<ros::WallTime>();
     qRegisterMetaType<audio_common_msgs::AudioDataConstPtr>();
 
 
@@ -69,13 +77,24 @@ int main(int argc, char *argv[])
     ImageViewer *yellowView = aw.findChild<ImageViewer*>("yellowView");
     ImageViewer *sandtrayView = aw.findChild<ImageViewer*>("sandtrayView");
 
-    Converter envConverter, purpleConverter, yellowConverter, sandtrayConverter;
+    // a single pool, sized to the machine, decodes and converts the frames of all the streams
+    TaskPool pool;
+
+    // frame counts and timings of each stage, per stream
+    PipelineStats pipelineStats;
+
+    Converter envConverter(pool), purpleConverter(pool), yellowConverter(pool), sandtrayConverter(pool);
     //sandtrayConverter.applyRotation(2); // Rotate 270 degrees clockwise
 
 
-    BagReader bagreader;
-    Thread bagReadingThread, envConverterThread, purpleConverterThread, yellowConverterThread, sandtrayConverterThread;
-    // Everything runs at the same priority as the gui, so it won't supply useless frames.
+    // the camera stepped frame by frame: the last one hovered. Declared before
+    // the bag reader, whose thread reads it.
+    std::atomic<VideoStream> steppedStream(VideoStream::ENV);
+
+    BagReader bagreader(pool);
+    bagreader.setPipelineStats(&pipelineStats);
+    Thread bagReadingThread;
+    // only the latest frame of each stream is converted, so they won't supply useless frames.
     envConverter.setProcessAll(false);
     purpleConverter.setProcessAll(false);
     yellowConverter.setProcessAll(false);
@@ -85,45 +104,77 @@ int main(int argc, char *argv[])
     bagReadingThread.start();
     bagreader.moveToThread(&bagReadingThread);
 
-    envConverterThread.start();
-    envConverterThread.setObjectName("env camera converter thread");
-    purpleConverterThread.start();
-    purpleConverterThread.setObjectName("purple camera converter thread");
-    yellowConverterThread.start();
-    yellowConverterThread.setObjectName("yellow camera converter thread");
-    sandtrayConverterThread.start();
-    sandtrayConverterThread.setObjectName("sandtray bg converter thread");
-
-    envConverter.moveToThread(&envConverterThread);
-    purpleConverter.moveToThread(&purpleConverterThread);
-    yellowConverter.moveToThread(&yellowConverterThread);
-    sandtrayConverter.moveToThread(&sandtrayConverterThread);
-
-    QObject::connect(&bagreader, &BagReader::envImgReady, &envConverter, &Converter::processFrame);
+    // frames are handed over to the converters straight from the decoding tasks
+    QObject::connect(&bagreader, &BagReader::envImgReady, &envConverter, &Converter::processFrame, Qt::DirectConnection);
     QObject::connect(&envConverter, &Converter::imageReady, envView, &ImageViewer::setImage);
 
-    QObject::connect(&bagreader, &BagReader::purpleImgReady, &purpleConverter, &Converter::processFrame);
+    QObject::connect(&bagreader, &BagReader::purpleImgReady, &purpleConverter, &Converter::processFrame, Qt::DirectConnection);
     QObject::connect(&purpleConverter, &Converter::imageReady, purpleView, &ImageViewer::setImage);
 
-    QObject::connect(&bagreader, &BagReader::yellowImgReady, &yellowConverter, &Converter::processFrame);
+    QObject::connect(&bagreader, &BagReader::yellowImgReady, &yellowConverter, &Converter::processFrame, Qt::DirectConnection);
     QObject::connect(&yellowConverter, &Converter::imageReady, yellowView, &ImageViewer::setImage);
 
-    QObject::connect(&bagreader, &BagReader::sandtrayImgReady, &sandtrayConverter, &Converter::processFrame);
+    QObject::connect(&bagreader, &BagReader::sandtrayImgReady, &sandtrayConverter, &Converter::processFrame, Qt::DirectConnection);
     QObject::connect(&sandtrayConverter, &Converter::imageReady, sandtrayView, &ImageViewer::setImage);
 
+    // hidden streams are not decoded; the stream under the mouse goes first
+    // (and is the one stepped frame by frame)
+    const vector<tuple<VideoStream, ImageViewer*, Converter*>> streams {
+        make_tuple(VideoStream::ENV, envView, &envConverter),
+        make_tuple(VideoStream::PURPLE, purpleView, &purpleConverter),
+        make_tuple(VideoStream::YELLOW, yellowView, &yellowConverter),
+        make_tuple(VideoStream::SANDTRAY, sandtrayView, &sandtrayConverter)};
+    for (const auto& stream : streams) {
+        auto type = get<0>(stream);
+        auto converter = get<2>(stream);
+        converter->setStats(&pipelineStats, type);
+        get<1>(stream)->setStats(&pipelineStats, type);
+        QObject::connect(get<1>(stream), &ImageViewer::shownChanged, [&bagreader, type](bool shown){bagreader.setViewerVisible(type, shown);});
+        QObject::connect(get<1>(stream), &ImageViewer::hoveredChanged, [&bagreader, &steppedStream, type, converter](bool hovered){
+            if (hovered) steppedStream = type;
+            auto priority = hovered ? TaskPool::Priority::HIGH : TaskPool::Priority::NORMAL;
+            bagreader.setViewerPriority(type, priority);
+            converter->setPriority(priority);
+        });
+    }
+
+    // decode the frames at a resolution matching the size of their viewer
+    QObject::connect(envView, &ImageViewer::resized, [&](const QSize& size){bagreader.setViewerSize(VideoStream::ENV, {size.width(), size.height()});});
+    QObject::connect(purpleView, &ImageViewer::resized, [&](const QSize& size){bagreader.setViewerSize(VideoStream::PURPLE, {size.width(), size.height()});});
+    QObject::connect(yellowView, &ImageViewer::resized, [&](const QSize& size){bagreader.setViewerSize(VideoStream::YELLOW, {size.width(), size.height()});});
+    QObject::connect(sandtrayView, &ImageViewer::resized, [&](const QSize& size){bagreader.setViewerSize(VideoStream::SANDTRAY, {size.width(), size.height()});});
+
     QObject::connect(&bagreader, &BagReader::audioFrameReady, &gstAudioPlayer, &GstAudioPlay::audioMsgReady);
 
 
     QObject::connect(&bagreader, &BagReader::started, [](){ qDebug() << "Starting to play the bag file"; });
 
-    QObject::connect(&app, &QApplication::lastWindowClosed, [&](){bagreader.stop();});
-
-    QObject::connect(&bagreader, &BagReader::durationUpdate, &aw, &AnnotatorWindow::showBagInfo);
-    QObject::connect(&bagreader, &BagReader::timeUpdate, timeline, &Timeline::setPlayhead);
+    QObject::connect(&app, &QApplication::lastWindowClosed, &bagreader, [&](){bagreader.stop();});
 
     QObject::connect(&bagreader, &BagReader::bagLoaded, timeline, &Timeline::initialize);
 
     QObject::connect(timeline, &Timeline::timeJump, &bagreader, &BagReader::setPlayTime);
+    QObject::connect(timeline, &Timeline::saved, &aw, &AnnotatorWindow::showSaveLatency);
+    QObject::connect(timeline, &Timeline::saveFailed, &aw, &AnnotatorWindow::showSaveError);
+
+    // while scrubbing or seeking, show the closest thumbnails until the actual frames are decoded
+    ThumbnailCache thumbnails;
+    auto showThumbnails = [&](ros::Time time) {
+        const vector<pair<VideoStream, ImageViewer*>> viewers {{VideoStream::ENV, envView},
+                                                               {VideoStream::PURPLE, purpleView},
+                                                               {VideoStream::YELLOW, yellowView},
+                                                               {VideoStream::SANDTRAY, sandtrayView}};
+        for (const auto& viewer : viewers) {
+            auto thumbnail = thumbnails.thumbnail(viewer.first, time);
+            if (!thumbnail.isNull()) viewer.second->setImage(thumbnail);
+        }
+    };
+    QObject::connect(timeline, &Timeline::scrub, showThumbnails);
+    QObject::connect(&bagreader, &BagReader::seeked, &aw, showThumbnails);
+    QObject::connect(&thumbnails, &ThumbnailCache::thumbnailsUpdated, timeline, &Timeline::thumbnailsUpdated);
+
+    AudioWaveform waveform;
+    QObject::connect(&waveform, &AudioWaveform::waveformUpdated, timeline, &Timeline::waveformUpdated);
 
     // HTTP server
 
@@ -146,19 +197,26 @@ int main(int argc, char *argv[])
     QObject::connect(timeline, &Timeline::togglePause, &bagreader, &BagReader::togglePause);
     QObject::connect(timeline, &Timeline::pause, &bagreader, &BagReader::pause);
 
+    QObject::connect(timeline, &Timeline::faster, &bagreader, &BagReader::faster);
+    QObject::connect(timeline, &Timeline::slower, &bagreader, &BagReader::slower);
+    QObject::connect(timeline, &Timeline::stepFrame, &bagreader, [&](int frames){bagreader.stepFrame(steppedStream, frames);});
+    QObject::connect(&bagreader, &BagReader::speedChanged, &aw, &AnnotatorWindow::showSpeed);
+    QObject::connect(&bagreader, &BagReader::speedChanged, &gstAudioPlayer, &GstAudioPlay::setTempo);
+
+    // the bag reader runs its own event loop: these are queued to its thread
     auto jumpBackLongBtn = aw.findChild<QPushButton*>("jumpBackLongBtn");
-    QObject::connect(jumpBackLongBtn, &QPushButton::clicked, [&](){bagreader.jumpBy(-10);});
+    QObject::connect(jumpBackLongBtn, &QPushButton::clicked, &bagreader, [&](){bagreader.jumpBy(-10);});
     auto jumpBackShortBtn = aw.findChild<QPushButton*>("jumpBackShortBtn");
-    QObject::connect(jumpBackShortBtn, &QPushButton::clicked, [&](){bagreader.jumpBy(-5);});
+    QObject::connect(jumpBackShortBtn, &QPushButton::clicked, &bagreader, [&](){bagreader.jumpBy(-5);});
     auto jumpFwdShortBtn = aw.findChild<QPushButton*>("jumpFwdShortBtn");
-    QObject::connect(jumpFwdShortBtn, &QPushButton::clicked, [&](){bagreader.jumpBy(5);});
+    QObject::connect(jumpFwdShortBtn, &QPushButton::clicked, &bagreader, [&](){bagreader.jumpBy(5);});
     auto jumpFwdLongBtn = aw.findChild<QPushButton*>("jumpFwdLongBtn");
-    QObject::connect(jumpFwdLongBtn, &QPushButton::clicked, [&](){bagreader.jumpBy(10);});
+    QObject::connect(jumpFwdLongBtn, &QPushButton::clicked, &bagreader, [&](){bagreader.jumpBy(10);});
 
     auto jumpStartBtn = aw.findChild<QPushButton*>("jumpStartBtn");
-    QObject::connect(jumpStartBtn, &QPushButton::clicked, [&](){bagreader.jumpTo(0);});
+    QObject::connect(jumpStartBtn, &QPushButton::clicked, &bagreader, [&](){bagreader.jumpTo(0);});
     auto jumpEndBtn = aw.findChild<QPushButton*>("jumpEndBtn");
-    QObject::connect(jumpEndBtn, &QPushButton::clicked, [&](){bagreader.jumpTo(-1);});
+    QObject::connect(jumpEndBtn, &QPushButton::clicked, &bagreader, [&](){bagreader.jumpTo(-1);});
 
 
     // Load bag file and start!
@@ -184,26 +242,77 @@ int main(int argc, char *argv[])
     if(fileName.isEmpty()) {return 1;}
         
     settings.setValue("recent", fileName);
+
+    // how much of the bag is read ahead of the playback. To be tuned per machine.
+    bagreader.setReadAhead(settings.value("prefetch/seconds", 5.).toDouble(),
+                           settings.value("prefetch/megabytes", 256).toUInt());
     bagreader.loadBag(fileName.toStdString());
+    thumbnails.build(fileName.toStdString(), bagreader.index());
+    timeline->setThumbnailCache(&thumbnails);
+    waveform.build(fileName.toStdString(), audioTopic());
+    timeline->setAudioWaveform(&waveform);
     QFileInfo fi(fileName);
-    QFileInfo annotationPath(fi.path() + "/" + fi.completeBaseName() + ".annotations." + name + ".yaml");
+    QFileInfo annotationPath(fi.path() + "/" + fi.completeBaseName() + ".annotations." + name + ".fpa");
+    // annotations saved by earlier versions, imported then saved in the binary format
+    QFileInfo yamlAnnotationPath(fi.path() + "/" + fi.completeBaseName() + ".annotations." + name + ".yaml");
+    bool loaded = false;
     if (annotationPath.exists()) {
-        timeline->loadFromFile(annotationPath.filePath().toStdString());
+        loaded = timeline->loadFromFile(annotationPath.filePath().toStdString());
+    }
+    else if (yamlAnnotationPath.exists()) {
+        loaded = timeline->loadFromFile(yamlAnnotationPath.filePath().toStdString());
+    }
+    if (!loaded) timeline->resetAnnotations();
+    // an annotation file that could not be loaded is not overwritten: no autosave until saved elsewhere (Ctrl+S)
+    if (loaded || !annotationPath.exists()) {
+        timeline->setSavePath(annotationPath.filePath().toStdString());
+        aw.showAutosavePath(annotationPath.filePath());
     }
     else {
-        timeline->resetAnnotations();
+        qWarning() << "Annotations not auto-saved, to preserve" << annotationPath.filePath();
     }
-    timeline->setSavePath(annotationPath.filePath().toStdString());
-    aw.showAutosavePath(annotationPath.filePath());
 
     QMetaObject::invokeMethod(&bagreader, "start");
 
-    // Configure HTTP server polling
+    // Configure HTTP server polling: every 20ms is responsive enough, and
+    // leaves the GUI thread idle while paused
     QTimer timer;
     QObject::connect(&timer, &QTimer::timeout, [&]{s.poll();});
-    timer.start();
-
-    return app.exec();
+    timer.start(20);
+
+    // the playhead follows the bag reader at display rate, not at the message rate of the bag
+    QTimer playheadTimer;
+    ros::Time playhead;
+    QObject::connect(&playheadTimer, &QTimer::timeout, [&]{
+        auto time = bagreader.clock().now();
+        if (time == playhead) return;
+        playhead = time;
+        timeline->setPlayhead(time);
+        aw.showBagInfo(time - bagreader.index().begin());
+    });
+    playheadTimer.start(16);
+
+    QTimer prefetchStatsTimer;
+    QObject::connect(&prefetchStatsTimer, &QTimer::timeout, [&]{
+        aw.showPrefetchStats(bagreader.prefetchStats());
+        if (aw.pipelineStatsShown()) aw.showPipelineStats(QString::fromStdString(pipelineStats.report()));
+    });
+    prefetchStatsTimer.start(1000);
+
+    // optionally, the pipeline statistics are also logged next to the bag, every minute and on exit
+    QTimer pipelineLogTimer;
+    auto pipelineLog = fileName.toStdString() + ".pipeline.log";
+    bool logPipeline = settings.value("pipeline/log", false).toBool();
+    QObject::connect(&pipelineLogTimer, &QTimer::timeout, [&]{
+        if (!pipelineStats.appendToLog(pipelineLog)) qWarning() << "Unable to write the pipeline statistics to" << QString::fromStdString(pipelineLog);
+    });
+    if (logPipeline) pipelineLogTimer.start(60 * 1000);
+
+    auto ret = app.exec();
+
+    if (logPipeline) pipelineStats.appendToLog(pipelineLog);
+
+    return ret;
 
 }
 
@@ -0,0 +1,118 @@
+#include <cmath>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+#include "bagreader.hpp"
+#include "pipelinestats.hpp"
+
+using namespace std;
+
+static const char* const STAGE_NAMES[] = {"read", "decode", "convert", "paint"};
+
+// upper bound of a histogram bucket, in ms
+static double bucketBound(size_t bucket)
+{
+    return ldexp(1., static_cast<int>(bucket)) / 4.;
+}
+
+PipelineStats::Histogram::Histogram() :
+    count_(0),
+    totalUs_(0)
+{
+    for (auto& bucket : buckets_) bucket.store(0);
+}
+
+void PipelineStats::Histogram::add(ros::WallDuration duration)
+{
+    double ms = max(0., duration.toSec() * 1000.);
+
+    size_t bucket = 0;
+    while (bucket < NB_BUCKETS - 1 && ms >= bucketBound(bucket)) bucket++;
+
+    buckets_[bucket].fetch_add(1, memory_order_relaxed);
+    count_.fetch_add(1, memory_order_relaxed);
+    totalUs_.fetch_add(static_cast<uint64_t>(ms * 1000.), memory_order_relaxed);
+}
+
+double PipelineStats::Histogram::mean() const
+{
+    auto n = count();
+    return n ? totalUs_.load(memory_order_relaxed) / 1000. / n : 0.;
+}
+
+double PipelineStats::Histogram::quantile(double q) const
+{
+    auto n = count();
+    if (n == 0) return 0.;
+
+    uint64_t rank = static_cast<uint64_t>(ceil(q * n));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < NB_BUCKETS - 1; i++) {
+        seen += buckets_[i].load(memory_order_relaxed);
+        if (seen >= rank) return bucketBound(i);
+    }
+    return INFINITY;
+}
+
+PipelineStats::PipelineStats()
+{
+    for (auto& stream : streams_) {
+        for (auto& stage : stream.stages) stage.dropped.store(0);
+    }
+}
+
+void PipelineStats::record(VideoStream stream, Stage stage, ros::WallDuration duration)
+{
+    this->stage(stream, stage).durations.add(duration);
+}
+
+void PipelineStats::dropped(VideoStream stream, Stage stage)
+{
+    this->stage(stream, stage).dropped.fetch_add(1, memory_order_relaxed);
+}
+
+void PipelineStats::displayed(VideoStream stream, ros::WallTime due)
+{
+    streams_[static_cast<size_t>(stream)].latency.add(ros::WallTime::now() - due);
+}
+
+string PipelineStats::report() const
+{
+    ostringstream out;
+    out << fixed << setprecision(1);
+
+    for (size_t s = 0; s < NB_VIDEO_STREAMS; s++) {
+        const auto& stream = streams_[s];
+
+        out << cameraTopic(static_cast<VideoStream>(s)) << ": "
+            << stream.latency.count() << " frames shown, latency p50 < " << stream.latency.quantile(.5)
+            << "ms, p95 < " << stream.latency.quantile(.95) << "ms\n";
+
+        for (size_t i = 0; i < NB_STAGES; i++) {
+            const auto& stage = stream.stages[i];
+            out << "  " << left << setw(8) << STAGE_NAMES[i] << right
+                << setw(8) << stage.durations.count() << " frames"
+                << "  mean " << setw(6) << stage.durations.mean() << "ms"
+                << "  p50 < " << setw(6) << stage.durations.quantile(.5) << "ms"
+                << "  p95 < " << setw(6) << stage.durations.quantile(.95) << "ms"
+                << "  dropped " << stage.dropped.load(memory_order_relaxed) << "\n";
+        }
+    }
+
+    return out.str();
+}
+
+bool PipelineStats::appendToLog(const string &path) const
+{
+    ofstream out(path, ios::app);
+    if (!out) return false;
+
+    auto now = time(nullptr);
+    char date[32];
+    strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&now));
+
+    out << "--- " << date << "\n" << report() << flush;
+    return bool(out);
+}
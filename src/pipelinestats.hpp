@@ -0,0 +1,90 @@
+#ifndef PIPELINESTATS_H
+#define PIPELINESTATS_H
+
+#include <array>
+#include <atomic>
+#include <string>
+
+#include <ros/time.h>
+
+#include "framedecoder.hpp"
+
+/**
+ * Frame counters and timing histograms of each stage of the video pipeline
+ * (reading from the bag, decoding, converting, painting), per camera stream,
+ * along with the end-to-end latency, from the time a frame is due (as per
+ * its bag timestamp) to the time it is painted.
+ *
+ * Histograms have power-of-two buckets (in milliseconds): quantiles are
+ * only known up to a factor 2, which is enough to tell which stage is the
+ * bottleneck.
+ *
+ * Lock-free and thread-safe: every stage records from its own thread.
+ */
+class PipelineStats
+{
+public:
+
+    enum class Stage {READ=0, DECODE, CONVERT, PAINT};
+    static const size_t NB_STAGES = 4;
+
+    // bucket i holds durations below 2^i / 4 ms; the last one, all the others
+    static const size_t NB_BUCKETS = 14;
+
+    class Histogram
+    {
+    public:
+        Histogram();
+
+        void add(ros::WallDuration duration);
+        uint64_t count() const {return count_.load(std::memory_order_relaxed);}
+        double mean() const; // in ms
+        /** the upper bound of the bucket holding the 'q' quantile, in ms */
+        double quantile(double q) const;
+
+    private:
+        std::array<std::atomic<uint64_t>, NB_BUCKETS> buckets_;
+        std::atomic<uint64_t> count_;
+        std::atomic<uint64_t> totalUs_;
+    };
+
+    PipelineStats();
+
+    PipelineStats(const PipelineStats&) = delete;
+    PipelineStats& operator=(const PipelineStats&) = delete;
+
+    /** a frame of 'stream' went through 'stage' in 'duration' */
+    void record(VideoStream stream, Stage stage, ros::WallDuration duration);
+
+    /** a frame of 'stream' was dropped at 'stage' (replaced by a newer one, or skipped) */
+    void dropped(VideoStream stream, Stage stage);
+
+    /** a frame of 'stream', due at 'due', was painted */
+    void displayed(VideoStream stream, ros::WallTime due);
+
+    /** a human-readable summary, one block per stream */
+    std::string report() const;
+
+    /** appends the current report, timestamped, to the file at 'path' */
+    bool appendToLog(const std::string& path) const;
+
+private:
+
+    struct StageStats {
+        Histogram durations;
+        std::atomic<uint64_t> dropped;
+    };
+
+    struct StreamStats {
+        std::array<StageStats, NB_STAGES> stages;
+        Histogram latency;
+    };
+
+    StageStats& stage(VideoStream stream, Stage stage) {
+        return streams_[static_cast<size_t>(stream)].stages[static_cast<size_t>(stage)];
+    }
+
+    std::array<StreamStats, NB_VIDEO_STREAMS> streams_;
+};
+
+#endif // PIPELINESTATS_H
@@ -0,0 +1,269 @@
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PIXELKERNELS_X86
+#include <immintrin.h>
+#endif
+
+#include "pixelkernels.hpp"
+
+using namespace std;
+
+// side of the tiles used for quarter turns, in pixels: a tile of source
+// rows (TILE_SIZE x 3 bytes each) comfortably fits in L1
+const int TILE_SIZE = 32;
+
+typedef void (*RowKernel)(const uint8_t* src, uint8_t* dst, int width);
+
+template<bool SWAP>
+static inline void copyPixel(const uint8_t* in, uint8_t* out)
+{
+    out[0] = in[SWAP ? 2 : 0];
+    out[1] = in[1];
+    out[2] = in[SWAP ? 0 : 2];
+}
+
+/** dst[x] = src[x], with R and B swapped if SWAP */
+template<bool SWAP>
+static void copyRowScalar(const uint8_t* src, uint8_t* dst, int width)
+{
+    if (!SWAP) {
+        std::copy(src, src + 3 * width, dst);
+        return;
+    }
+    for (int x = 0; x < width; x++) copyPixel<SWAP>(src + 3 * x, dst + 3 * x);
+}
+
+/** dst[x] = src[width - 1 - x], with R and B swapped if SWAP */
+template<bool SWAP>
+static void reverseRowScalar(const uint8_t* src, uint8_t* dst, int width)
+{
+    if (SWAP) {
+        // reversing the bytes of a row both reverses the pixels and swaps R and B
+        std::reverse_copy(src, src + 3 * width, dst);
+        return;
+    }
+    for (int x = 0; x < width; x++) copyPixel<SWAP>(src + 3 * (width - 1 - x), dst + 3 * x);
+}
+
+#ifdef PIXELKERNELS_X86
+
+// the SIMD kernels work on groups of 5 pixels (15 bytes): each 16-byte load
+// or store covers one group, plus one byte that is either ignored, or
+// overwritten by the next group. Rows that only need copying (no swap, no
+// reversal) use std::copy.
+
+__attribute__((target("ssse3")))
+static inline __m128i swapMask()
+{
+    return _mm_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, 14, 13, 12, 15);
+}
+
+// reversing loads start one byte before the group, to stay within the row
+__attribute__((target("ssse3")))
+static inline __m128i reverseMask(bool swap)
+{
+    return swap ? _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, -1)
+                : _mm_setr_epi8(13, 14, 15, 10, 11, 12, 7, 8, 9, 4, 5, 6, 1, 2, 3, -1);
+}
+
+__attribute__((target("ssse3")))
+static void swapRowSSSE3(const uint8_t* src, uint8_t* dst, int width)
+{
+    const __m128i mask = swapMask();
+
+    int x = 0;
+    for (; x + 6 <= width; x += 5) {
+        auto pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 3 * x));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 3 * x), _mm_shuffle_epi8(pixels, mask));
+    }
+    copyRowScalar<true>(src + 3 * x, dst + 3 * x, width - x);
+}
+
+template<bool SWAP>
+__attribute__((target("ssse3")))
+static void reverseRowSSSE3(const uint8_t* src, uint8_t* dst, int width)
+{
+    const __m128i mask = reverseMask(SWAP);
+
+    int x = 0;
+    for (; x + 6 <= width; x += 5) {
+        auto pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 3 * (width - 5 - x) - 1));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 3 * x), _mm_shuffle_epi8(pixels, mask));
+    }
+    reverseRowScalar<SWAP>(src, dst + 3 * x, width - x);
+}
+
+// AVX2 shuffles work within 128-bit lanes: each lane holds one group
+
+__attribute__((target("avx2")))
+static inline __m256i bothLanes(__m128i mask)
+{
+    return _mm256_inserti128_si256(_mm256_castsi128_si256(mask), mask, 1);
+}
+
+__attribute__((target("avx2")))
+static void swapRowAVX2(const uint8_t* src, uint8_t* dst, int width)
+{
+    const __m256i mask = bothLanes(swapMask());
+
+    int x = 0;
+    for (; x + 11 <= width; x += 10) {
+        auto low = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 3 * x));
+        auto high = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 3 * x + 15));
+        auto pixels = _mm256_shuffle_epi8(_mm256_inserti128_si256(_mm256_castsi128_si256(low), high, 1), mask);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 3 * x), _mm256_castsi256_si128(pixels));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 3 * x + 15), _mm256_extracti128_si256(pixels, 1));
+    }
+    swapRowSSSE3(src + 3 * x, dst + 3 * x, width - x);
+}
+
+template<bool SWAP>
+__attribute__((target("avx2")))
+static void reverseRowAVX2(const uint8_t* src, uint8_t* dst, int width)
+{
+    const __m256i mask = bothLanes(reverseMask(SWAP));
+
+    int x = 0;
+    for (; x + 11 <= width; x += 10) {
+        auto low = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 3 * (width - 5 - x) - 1));
+        auto high = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 3 * (width - 10 - x) - 1));
+        auto pixels = _mm256_shuffle_epi8(_mm256_inserti128_si256(_mm256_castsi128_si256(low), high, 1), mask);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 3 * x), _mm256_castsi256_si128(pixels));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 3 * x + 15), _mm256_extracti128_si256(pixels, 1));
+    }
+    reverseRowSSSE3<SWAP>(src, dst + 3 * x, width - x);
+}
+
+#endif // PIXELKERNELS_X86
+
+static bool isSupported(KernelISA isa)
+{
+#ifdef PIXELKERNELS_X86
+    // the CPU model data __builtin_cpu_supports relies on is only guaranteed
+    // to be set up once this has run (not yet, from static initializers)
+    __builtin_cpu_init();
+#endif
+
+    switch (isa) {
+    case KernelISA::SCALAR: return true;
+#ifdef PIXELKERNELS_X86
+    case KernelISA::SSSE3: return __builtin_cpu_supports("ssse3");
+    case KernelISA::AVX2: return __builtin_cpu_supports("avx2");
+#endif
+    default: return false;
+    }
+}
+
+static KernelISA bestISA()
+{
+    if (isSupported(KernelISA::AVX2)) return KernelISA::AVX2;
+    if (isSupported(KernelISA::SSSE3)) return KernelISA::SSSE3;
+    return KernelISA::SCALAR;
+}
+
+/** the ISA in use, picked on first use: the best supported, unless set with setKernelISA() */
+static KernelISA& currentISA()
+{
+    static KernelISA isa = bestISA();
+    return isa;
+}
+
+KernelISA kernelISA()
+{
+    return currentISA();
+}
+
+bool setKernelISA(KernelISA isa)
+{
+    if (!isSupported(isa)) return false;
+    currentISA() = isa;
+    return true;
+}
+
+const char* kernelISAName(KernelISA isa)
+{
+    switch (isa) {
+    case KernelISA::SCALAR: return "scalar";
+    case KernelISA::SSSE3: return "SSSE3";
+    case KernelISA::AVX2: return "AVX2";
+    }
+    return "";
+}
+
+static void rowKernels(bool swapRB, RowKernel& copyRow, RowKernel& reverseRow)
+{
+    copyRow = swapRB ? copyRowScalar<true> : copyRowScalar<false>;
+    reverseRow = swapRB ? reverseRowScalar<true> : reverseRowScalar<false>;
+
+    switch (currentISA()) {
+#ifdef PIXELKERNELS_X86
+    case KernelISA::AVX2:
+        if (swapRB) copyRow = swapRowAVX2;
+        reverseRow = swapRB ? reverseRowAVX2<true> : reverseRowAVX2<false>;
+        break;
+    case KernelISA::SSSE3:
+        if (swapRB) copyRow = swapRowSSSE3;
+        reverseRow = swapRB ? reverseRowSSSE3<true> : reverseRowSSSE3<false>;
+        break;
+#endif
+    default:
+        break;
+    }
+}
+
+/**
+ * Quarter turns: the destination is height x width. Each destination row
+ * is a source column, walked by tiles of TILE_SIZE x TILE_SIZE pixels.
+ */
+template<bool SWAP>
+static void rotateQuarter(const uint8_t* src, int width, int height, size_t srcStep,
+                          uint8_t* dst, size_t dstStep,
+                          bool clockwise)
+{
+    int dstWidth = height, dstHeight = width;
+
+    for (int ty = 0; ty < dstHeight; ty += TILE_SIZE) {
+        for (int tx = 0; tx < dstWidth; tx += TILE_SIZE) {
+            int yEnd = std::min(ty + TILE_SIZE, dstHeight);
+            int xEnd = std::min(tx + TILE_SIZE, dstWidth);
+
+            for (int y = ty; y < yEnd; y++) {
+                auto out = dst + y * dstStep + 3 * tx;
+
+                if (clockwise) {
+                    // dst(x, y) = src(y, height - 1 - x)
+                    auto in = src + (height - 1 - tx) * srcStep + 3 * y;
+                    for (int x = tx; x < xEnd; x++, out += 3, in -= srcStep) copyPixel<SWAP>(in, out);
+                }
+                else {
+                    // dst(x, y) = src(width - 1 - y, x)
+                    auto in = src + tx * srcStep + 3 * (width - 1 - y);
+                    for (int x = tx; x < xEnd; x++, out += 3, in += srcStep) copyPixel<SWAP>(in, out);
+                }
+            }
+        }
+    }
+}
+
+void rotatePixels(const uint8_t* src, int width, int height, size_t srcStep,
+                  uint8_t* dst, size_t dstStep,
+                  int quarterTurns, bool swapRB)
+{
+    quarterTurns = ((quarterTurns % 4) + 4) % 4;
+
+    RowKernel copyRow, reverseRow;
+    rowKernels(swapRB, copyRow, reverseRow);
+
+    switch (quarterTurns) {
+    case 0:
+        for (int y = 0; y < height; y++) copyRow(src + y * srcStep, dst + y * dstStep, width);
+        break;
+    case 2:
+        for (int y = 0; y < height; y++) reverseRow(src + (height - 1 - y) * srcStep, dst + y * dstStep, width);
+        break;
+    default:
+        if (swapRB) rotateQuarter<true>(src, width, height, srcStep, dst, dstStep, quarterTurns == 1);
+        else rotateQuarter<false>(src, width, height, srcStep, dst, dstStep, quarterTurns == 1);
+    }
+}
@@ -0,0 +1,35 @@
+#ifndef PIXELKERNELS_H
+#define PIXELKERNELS_H
+
+#include <cstddef>
+#include <cstdint>
+
+/** Instruction sets the pixel kernels are implemented with */
+enum class KernelISA {SCALAR, SSSE3, AVX2};
+
+/** Returns the instruction set currently used: the best one the CPU supports, unless forced */
+KernelISA kernelISA();
+
+/**
+ * Forces the instruction set used by the kernels (for benchmarks). Returns
+ * false, and changes nothing, if the CPU does not support it.
+ */
+bool setKernelISA(KernelISA isa);
+
+const char* kernelISAName(KernelISA isa);
+
+/**
+ * Rotates a packed 24-bit image by 'quarterTurns' clockwise quarter turns
+ * (0 to 3) and, if 'swapRB', swaps its first and third channels (BGR <->
+ * RGB) in the same pass.
+ *
+ * 'dst' must hold height x width pixels if 'quarterTurns' is odd, width x
+ * height otherwise, and must not overlap 'src'. Rows are converted with SIMD
+ * shuffles when not rotated or rotated by 180 degrees; quarter turns are
+ * done by tiles, so that the source rows being read stay in cache.
+ */
+void rotatePixels(const uint8_t* src, int width, int height, size_t srcStep,
+                  uint8_t* dst, size_t dstStep,
+                  int quarterTurns, bool swapRB);
+
+#endif // PIXELKERNELS_H
@@ -0,0 +1,39 @@
+#ifndef PLAYBACKCLOCK_H
+#define PLAYBACKCLOCK_H
+
+#include <atomic>
+#include <cstdint>
+
+#include <ros/time.h>
+
+/**
+ * The current playback time, published by the bag reader for every message
+ * it plays, and sampled by the GUI at display rate.
+ *
+ * Whatever the message rate of the bag (hundreds of Hz with audio), the GUI
+ * is updated at most once per refresh, instead of processing a backlog of
+ * queued time updates. The sampled time is still the exact timestamp of the
+ * latest message played.
+ *
+ * Lock-free and thread-safe.
+ */
+class PlaybackClock
+{
+public:
+
+    PlaybackClock() : time_(0) {}
+
+    void publish(ros::Time time) {time_.store(time.toNSec(), std::memory_order_release);}
+
+    ros::Time now() const {
+        ros::Time time;
+        time.fromNSec(time_.load(std::memory_order_acquire));
+        return time;
+    }
+
+private:
+
+    std::atomic<uint64_t> time_; // in nanoseconds
+};
+
+#endif // PLAYBACKCLOCK_H
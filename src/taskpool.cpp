@@ -0,0 +1,101 @@
+#include <algorithm>
+
+#include "taskpool.hpp"
+
+using namespace std;
+
+namespace {
+// index of the worker running on the current thread, if any
+thread_local TaskPool* currentPool = nullptr;
+thread_local size_t currentWorker = 0;
+}
+
+TaskPool::TaskPool(size_t nbThreads) :
+    nextWorker_(0),
+    pending_(0),
+    stopping_(false)
+{
+    if (nbThreads == 0) {
+        auto cores = thread::hardware_concurrency();
+        nbThreads = max(1u, cores > 1 ? cores - 1 : 1u);
+    }
+
+    for (size_t i = 0; i < nbThreads; i++) workers_.emplace_back(new Worker);
+    for (size_t i = 0; i < nbThreads; i++) threads_.emplace_back(&TaskPool::run, this, i);
+}
+
+TaskPool::~TaskPool()
+{
+    {
+        lock_guard<mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    wakeup_.notify_all();
+
+    for (auto& t : threads_) t.join();
+}
+
+void TaskPool::submit(Task task, Priority priority)
+{
+    size_t idx = (currentPool == this) ? currentWorker
+                                       : nextWorker_++ % workers_.size();
+    {
+        lock_guard<mutex> lock(workers_[idx]->mutex);
+        workers_[idx]->tasks[static_cast<size_t>(priority)].push_back(move(task));
+    }
+    {
+        lock_guard<mutex> lock(mutex_);
+        pending_++;
+    }
+    wakeup_.notify_one();
+}
+
+bool TaskPool::pop(size_t idx, size_t priority, Task& task)
+{
+    auto& worker = *workers_[idx];
+    lock_guard<mutex> lock(worker.mutex);
+    auto& tasks = worker.tasks[priority];
+    if (tasks.empty()) return false;
+    task = move(tasks.front());
+    tasks.pop_front();
+    return true;
+}
+
+bool TaskPool::steal(size_t idx, size_t priority, Task& task)
+{
+    for (size_t i = 1; i < workers_.size(); i++) {
+        auto& victim = *workers_[(idx + i) % workers_.size()];
+        lock_guard<mutex> lock(victim.mutex);
+        auto& tasks = victim.tasks[priority];
+        if (tasks.empty()) continue;
+        task = move(tasks.back());
+        tasks.pop_back();
+        return true;
+    }
+    return false;
+}
+
+void TaskPool::run(size_t idx)
+{
+    currentPool = this;
+    currentWorker = idx;
+
+    while (true) {
+        {
+            unique_lock<mutex> lock(mutex_);
+            wakeup_.wait(lock, [this]{return stopping_ || pending_ > 0;});
+            if (stopping_) return;
+            pending_--;
+        }
+
+        // a task is pending somewhere: it is ours, or we steal it, highest
+        // priority first
+        Task task;
+        bool found = false;
+        while (!found) {
+            for (size_t p = 0; p < NB_PRIORITIES && !found; p++) found = pop(idx, p, task) || steal(idx, p, task);
+            if (!found) this_thread::yield();
+        }
+        task();
+    }
+}
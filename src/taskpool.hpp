@@ -0,0 +1,67 @@
+#ifndef TASKPOOL_H
+#define TASKPOOL_H
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * A small work-stealing thread pool.
+ *
+ * Each worker owns a task queue. Tasks submitted from outside the pool are
+ * spread round-robin over the workers; tasks submitted from a worker go to
+ * its own queue. An idle worker first empties its own queue (oldest task
+ * first), then steals the most recent tasks of the other workers.
+ *
+ * Tasks have a priority: a worker only runs a NORMAL task if no HIGH task is
+ * queued, in its own queue or any other.
+ */
+class TaskPool
+{
+public:
+
+    typedef std::function<void()> Task;
+
+    enum class Priority {HIGH=0, NORMAL};
+    static const size_t NB_PRIORITIES = 2;
+
+    /** 'nbThreads' defaults to the number of cores, minus one for the GUI. */
+    explicit TaskPool(size_t nbThreads = 0);
+    ~TaskPool();
+
+    TaskPool(const TaskPool&) = delete;
+    TaskPool& operator=(const TaskPool&) = delete;
+
+    void submit(Task task, Priority priority = Priority::NORMAL);
+
+    size_t size() const {return workers_.size();}
+
+private:
+
+    struct Worker {
+        std::mutex mutex;
+        std::array<std::deque<Task>, NB_PRIORITIES> tasks; // one queue per priority
+    };
+
+    void run(size_t idx);
+    bool pop(size_t idx, size_t priority, Task& task);
+    bool steal(size_t idx, size_t priority, Task& task);
+
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::vector<std::thread> threads_;
+
+    std::atomic<size_t> nextWorker_;
+
+    std::mutex mutex_;
+    std::condition_variable wakeup_;
+    size_t pending_;
+    bool stopping_;
+};
+
+#endif // TASKPOOL_H
@@ -0,0 +1,219 @@
+#include <fstream>
+#include <vector>
+
+#include <QDebug>
+#include <QDateTime>
+#include <QFile>
+#include <QFileInfo>
+
+#include <opencv2/opencv.hpp>
+#include <rosbag/bag.h>
+#include <rosbag/view.h>
+#include <sensor_msgs/CompressedImage.h>
+
+#include "bagreader.hpp"
+#include "binaryio.hpp"
+#include "thumbnailcache.hpp"
+
+using namespace std;
+
+const ros::Duration ThumbnailCache::INTERVAL(1.);
+const int ThumbnailCache::WIDTH = 160;
+const uint32_t ThumbnailCache::VERSION = 1;
+
+const char THUMBNAILS_MAGIC[] = "FPTHB";
+
+// size of a record header: stream (1 byte), timestamp (2x4 bytes), JPEG size (4 bytes)
+const size_t RECORD_HEADER_SIZE = 13;
+
+ThumbnailCache::ThumbnailCache(QObject *parent) :
+    QObject(parent),
+    stopping_(false)
+{
+}
+
+ThumbnailCache::~ThumbnailCache()
+{
+    stopping_ = true;
+    if (thread_.joinable()) thread_.join();
+}
+
+void ThumbnailCache::build(const string &bagpath, const BagIndex &index)
+{
+    stopping_ = true;
+    if (thread_.joinable()) thread_.join();
+    stopping_ = false;
+
+    QFileInfo fi(QString::fromStdString(bagpath));
+    uint64_t bagsize = fi.size();
+    int64_t bagmtime = fi.lastModified().toMSecsSinceEpoch();
+
+    cachepath_ = bagpath + ".thumbnails";
+
+    {
+        lock_guard<mutex> lock(mutex_);
+        for (auto& entries : entries_) entries.clear();
+    }
+
+    if (!readCache(bagsize, bagmtime)) resetCache(bagsize, bagmtime);
+
+    thread_ = std::thread(&ThumbnailCache::generate, this, bagpath, index);
+}
+
+QImage ThumbnailCache::thumbnail(VideoStream stream, ros::Time time) const
+{
+    Entry entry;
+    {
+        lock_guard<mutex> lock(mutex_);
+        const auto& entries = entries_[static_cast<size_t>(stream)];
+        auto it = entries.upper_bound(time);
+        if (it == entries.begin()) return {};
+        entry = (--it)->second;
+    }
+
+    ifstream in(cachepath_, ios::binary);
+    vector<char> data(entry.size);
+    if (!in.seekg(entry.offset) || !in.read(data.data(), entry.size)) return {};
+
+    return QImage::fromData(reinterpret_cast<const uchar*>(data.data()), entry.size, "JPG");
+}
+
+bool ThumbnailCache::readCache(uint64_t bagsize, int64_t bagmtime)
+{
+    ifstream in(cachepath_, ios::binary);
+    if (!in) return false;
+
+    char magic[sizeof(THUMBNAILS_MAGIC)];
+    uint32_t version;
+    uint64_t size;
+    int64_t mtime;
+
+    if (!in.read(magic, sizeof(magic)) || !equal(magic, magic + sizeof(magic), THUMBNAILS_MAGIC)) return false;
+    if (!readPod(in, version) || version != VERSION) return false;
+    if (!readPod(in, size) || size != bagsize) return false;
+    if (!readPod(in, mtime) || mtime != bagmtime) return false;
+
+    in.seekg(0, ios::end);
+    uint64_t filesize = in.tellg();
+
+    uint64_t offset = sizeof(magic) + sizeof(version) + sizeof(size) + sizeof(mtime);
+    in.seekg(offset);
+
+    lock_guard<mutex> lock(mutex_);
+
+    uint8_t stream;
+    uint32_t sec, nsec, len;
+    while (readPod(in, stream) && readPod(in, sec) && readPod(in, nsec) && readPod(in, len)) {
+        if (stream >= NB_VIDEO_STREAMS || offset + RECORD_HEADER_SIZE + len > filesize) break;
+
+        entries_[stream][ros::Time(sec, nsec)] = {offset + RECORD_HEADER_SIZE, len};
+        offset += RECORD_HEADER_SIZE + len;
+        in.seekg(offset);
+    }
+    in.close();
+
+    // drop a record that was only partially written
+    if (offset < filesize) QFile::resize(QString::fromStdString(cachepath_), offset);
+
+    return true;
+}
+
+void ThumbnailCache::resetCache(uint64_t bagsize, int64_t bagmtime)
+{
+    ofstream out(cachepath_, ios::binary | ios::trunc);
+    if (!out) {
+        qWarning() << "Unable to write thumbnails to" << QString::fromStdString(cachepath_);
+        return;
+    }
+
+    out.write(THUMBNAILS_MAGIC, sizeof(THUMBNAILS_MAGIC));
+    writePod(out, VERSION);
+    writePod(out, bagsize);
+    writePod(out, bagmtime);
+}
+
+void ThumbnailCache::generate(string bagpath, BagIndex index)
+{
+    // the playback has its own handle on the bag: rosbag::Bag is not thread-safe
+    rosbag::Bag bag;
+    try {
+        bag.open(bagpath, rosbag::bagmode::Read);
+    }
+    catch (const rosbag::BagException& e) {
+        qWarning() << "Unable to generate thumbnails:" << e.what();
+        return;
+    }
+
+    fstream out(cachepath_, ios::binary | ios::in | ios::out);
+    if (!out) return;
+    out.seekp(0, ios::end);
+
+    auto lastUpdate = ros::WallTime::now();
+    size_t nbGenerated = 0;
+    // range of the thumbnails changed since the last emission
+    auto updatedFrom = ros::TIME_MAX;
+    auto updatedTo = ros::TIME_MIN;
+
+    // coarse to fine: the whole bag is quickly covered, then refined
+    for (int stride : {16, 4, 1}) {
+        for (auto t = index.begin(); t <= index.end(); t += INTERVAL * stride) {
+            for (size_t s = 0; s < NB_VIDEO_STREAMS; s++) {
+
+                if (stopping_) return;
+
+                const auto& topic = cameraTopic(static_cast<VideoStream>(s));
+                auto frametime = index.seek(topic, t);
+                {
+                    lock_guard<mutex> lock(mutex_);
+                    if (entries_[s].count(frametime)) continue;
+                }
+
+                rosbag::View view(bag, rosbag::TopicQuery(topic), frametime, frametime);
+                if (view.begin() == view.end()) continue;
+
+                auto msg = view.begin()->instantiate<sensor_msgs::CompressedImage>();
+                if (!msg) continue;
+
+                auto frame = cv::imdecode(msg->data, cv::IMREAD_REDUCED_COLOR_4);
+                if (frame.empty()) continue;
+                cv::resize(frame, frame, cv::Size(WIDTH, WIDTH * frame.rows / frame.cols), 0, 0, cv::INTER_AREA);
+
+                vector<uchar> jpeg;
+                cv::imencode(".jpg", frame, jpeg, {cv::IMWRITE_JPEG_QUALITY, 70});
+
+                uint64_t offset = out.tellp();
+                writePod(out, static_cast<uint8_t>(s));
+                writePod(out, frametime.sec);
+                writePod(out, frametime.nsec);
+                writePod(out, static_cast<uint32_t>(jpeg.size()));
+                out.write(reinterpret_cast<const char*>(jpeg.data()), jpeg.size());
+                if (!out.flush()) {
+                    qWarning() << "Unable to write thumbnails to" << QString::fromStdString(cachepath_);
+                    return;
+                }
+
+                {
+                    lock_guard<mutex> lock(mutex_);
+                    auto& entries = entries_[s];
+                    auto it = entries.insert({frametime, {offset + RECORD_HEADER_SIZE, static_cast<uint32_t>(jpeg.size())}}).first;
+
+                    // the new thumbnail is returned until the next one
+                    auto next = std::next(it);
+                    updatedFrom = min(updatedFrom, frametime);
+                    updatedTo = max(updatedTo, next == entries.end() ? index.end() : next->first);
+                }
+                nbGenerated++;
+
+                if (ros::WallTime::now() - lastUpdate > ros::WallDuration(1.)) {
+                    lastUpdate = ros::WallTime::now();
+                    emit thumbnailsUpdated(updatedFrom, updatedTo);
+                    updatedFrom = ros::TIME_MAX;
+                    updatedTo = ros::TIME_MIN;
+                }
+            }
+        }
+    }
+
+    qDebug() << "Thumbnails generated:" << nbGenerated;
+    if (updatedFrom <= updatedTo) emit thumbnailsUpdated(updatedFrom, updatedTo);
+}
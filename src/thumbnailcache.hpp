@@ -0,0 +1,84 @@
+#ifndef THUMBNAILCACHE_H
+#define THUMBNAILCACHE_H
+
+#include <array>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <QObject>
+#include <QImage>
+#include <ros/time.h>
+
+#include "bagindex.hpp"
+#include "framedecoder.hpp"
+
+/**
+ * On-disk cache of small JPEG thumbnails of every camera stream, sampled
+ * every INTERVAL of the bag.
+ *
+ * Thumbnails are generated in the background (coarse to fine, so that the
+ * whole bag is quickly covered) and appended to '<bag>.thumbnails' as they
+ * are produced, so that an interrupted generation resumes where it stopped.
+ * Like the bag index, the cache is discarded if the bag changes.
+ *
+ * They are used to show something meaningful straight away while scrubbing
+ * or seeking, before the actual frames are read and decoded.
+ */
+class ThumbnailCache : public QObject
+{
+    Q_OBJECT
+
+public:
+
+    static const ros::Duration INTERVAL;
+    static const int WIDTH;
+
+    ThumbnailCache(QObject* parent = nullptr);
+    ~ThumbnailCache();
+
+    /**
+     * Loads the thumbnails cached for the bag at 'bagpath', and starts
+     * generating the missing ones in the background.
+     */
+    void build(const std::string& bagpath, const BagIndex& index);
+
+    /**
+     * Returns the latest thumbnail of 'stream' at or before 'time' (or a
+     * null image if none is available yet).
+     * Thread-safe.
+     */
+    QImage thumbnail(VideoStream stream, ros::Time time) const;
+
+    /**
+     * emitted regularly while thumbnails are being generated, with the time
+     * range over which thumbnail() returns a different image since the last
+     * emission
+     */
+    Q_SIGNAL void thumbnailsUpdated(ros::Time from, ros::Time to);
+
+private:
+
+    struct Entry {
+        uint64_t offset; // of the JPEG data in the cache file
+        uint32_t size;
+    };
+
+    static const uint32_t VERSION;
+
+    bool readCache(uint64_t bagsize, int64_t bagmtime);
+    void resetCache(uint64_t bagsize, int64_t bagmtime);
+    void generate(std::string bagpath, BagIndex index);
+
+    std::string cachepath_;
+
+    mutable std::mutex mutex_;
+    std::array<std::map<ros::Time, Entry>, NB_VIDEO_STREAMS> entries_;
+
+    std::atomic<bool> stopping_;
+    std::thread thread_;
+};
+
+#endif // THUMBNAILCACHE_H
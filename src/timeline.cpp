@@ -12,27 +12,101 @@
 #include <algorithm>
 #include <iostream>
 #include <fstream>
+#include <map>
 #include <QFileDialog>
+#include <QFileInfo>
+#include <QPixmapCache>
 
-#include <yaml-cpp/yaml.h>
-
+#include "annotationio.hpp"
+#include "audiowaveform.hpp"
+#include "thumbnailcache.hpp"
 #include "timeline.hpp"
 
 using namespace std;
 
+// the filmstrip is rendered by tiles of FILMSTRIP_TILE_WIDTH px, cached for each zoom level
+const int FILMSTRIP_TILE_WIDTH = 256;
+const int FILMSTRIP_HEIGHT = 40;
+const int FILMSTRIP_MAX_TILES_PER_PAINT = 4;
+const int FILMSTRIP_REFRESH_INTERVAL = 100; // ms
+const double FILMSTRIP_BUCKET_DURATION = 10.; // s
+
+const int WAVEFORM_HEIGHT = 24;
+
+// vertical layout of the lanes
+const int YELLOW_ANNOTATIONS_OFFSET = 10;
+const int PURPLE_ANNOTATIONS_OFFSET = 60;
+const int FILMSTRIP_OFFSET = 105;
+const int WAVEFORM_OFFSET = 150;
+
+// the cached layers are LAYER_SPAN times as wide as the widget
+const int LAYER_SPAN = 3;
+
+// annotations narrower than LOD_MIN_WIDTH px are merged into bands
+const double LOD_MIN_WIDTH = 3.;
+
+static int categoryOffset(AnnotationCategory category)
+{
+    if(category == AnnotationCategory::SOCIAL_ENGAGEMENT) return 20;
+    if(category == AnnotationCategory::SOCIAL_ATTITUDE) return 35;
+    return 5;
+}
+
+/** a run of consecutive annotations, too short to be drawn individually */
+struct AnnotationBand
+{
+    double x1 = 0., x2 = 0.;
+    typedef std::map<std::pair<AnnotationType, bool>, double> Durations;
+    Durations durations; // per (type, isConflicted)
+};
+
+/** draws 'band' with the colour of the annotation type covering most of it */
+static void drawBand(QPainter *painter, const AnnotationBand& band, int y)
+{
+    if (band.durations.empty()) return;
+
+    auto dominant = std::max_element(band.durations.begin(), band.durations.end(),
+                                     [](const AnnotationBand::Durations::value_type& a,
+                                        const AnnotationBand::Durations::value_type& b) {return a.second < b.second;})->first;
+
+    QPen pen(dominant.second ? Annotation::CONFLICT_PEN : Annotation::Styles[dominant.first]);
+    pen.setStyle(Qt::SolidLine);
+    pen.setCapStyle(Qt::FlatCap);
+    painter->setPen(pen);
+    painter->drawLine(QLineF(band.x1, y, std::max(band.x2, band.x1 + 1), y));
+}
+
 
 Timeline::Timeline(QWidget *parent):
           timescale_(1.),
           autosaveTimer(this),
-          annotationPath("/tmp/freeplay-annotations.yaml"),
+          annotationPath("/tmp/freeplay-annotations.fpa"),
           _color_background(QColor("#393939")),
           _color_playhead(QColor("#FF2F00")),
           _color_light(QColor("#7F7F7FAA")),
           _color_bg_text(QColor("#a1a1a1")),
           _brush_background(_color_background),
-          mergeMode(false)
+          mergeMode(false),
+          consensusRevisions_(0, 0),
+          scrubbing_(false),
+          thumbnails_(nullptr),
+          filmstripGeneration_(0),
+          filmstripTimer_(this),
+          waveform_(nullptr),
+          layerStartPx_(0.),
+          layerPxPerSec_(0.),
+          backgroundLayerValid_(false),
+          annotationLayerValid_(false),
+          layerRevisions_(0, 0),
+          journalSize_(0),
+          savedRevisions_(0, 0)
 {
-    connect(&autosaveTimer, &QTimer::timeout, [&](){saveToFile("");});
+    connect(&autosaveTimer, &QTimer::timeout, this, &Timeline::autosave);
+    filmstripTimer_.setSingleShot(true);
+    filmstripTimer_.setInterval(FILMSTRIP_REFRESH_INTERVAL);
+    connect(&filmstripTimer_, &QTimer::timeout, this, &Timeline::refreshFilmstrip);
+    connect(&writer_, &AnnotationWriter::saved, this, &Timeline::saved);
+    connect(&writer_, &AnnotationWriter::saveFailed, this, &Timeline::retrySave);
     autosaveTimer.start(1000);
 }
 
@@ -42,6 +116,9 @@ void Timeline::initialize(ros::Time begin, ros::Time end)
     current_ = begin;
     end_ = end;
 
+    backgroundLayerValid_ = false;
+    annotationLayerValid_ = false;
+
 
     //freeAnnotations.push_back(make_shared<FreeAnnotationWidget>(begin_ + ros::Duration(10), FreeAnnotationType::INTERESTING, "hello world"));
     //freeAnnotations.push_back(make_shared<FreeAnnotationWidget>(begin_ + ros::Duration(20), FreeAnnotationType::ISSUE, "hello world issue"));
@@ -122,61 +199,166 @@ void Timeline::resetAnnotations() {
         yellowAnnotations.add({AnnotationType::PASSIVE, begin_, begin_});
 }
 
+void Timeline::setThumbnailCache(const ThumbnailCache *thumbnails)
+{
+    thumbnails_ = thumbnails;
+    filmstripGeneration_++;
+    filmstripRevisions_.clear();
+    backgroundLayerValid_ = false;
+    update();
+}
+
+void Timeline::thumbnailsUpdated(ros::Time from, ros::Time to)
+{
+    if (to < begin_ || from > end_) return;
+
+    auto bucket = [this](ros::Time time) {
+        return static_cast<size_t>(std::max(0., (std::min(time, end_) - begin_).toSec()) / FILMSTRIP_BUCKET_DURATION);
+    };
+    auto last = bucket(to);
+    if (filmstripRevisions_.size() <= last) filmstripRevisions_.resize(last + 1, 0);
+    for (auto b = bucket(from); b <= last; b++) filmstripRevisions_[b]++;
+
+    // thumbnails keep coming while they are generated: refreshes are throttled
+    if (!filmstripTimer_.isActive()) filmstripTimer_.start();
+}
+
+void Timeline::setAudioWaveform(const AudioWaveform *waveform)
+{
+    waveform_ = waveform;
+    waveformUpdated();
+}
+
+void Timeline::waveformUpdated()
+{
+    backgroundLayerValid_ = false;
+    update();
+}
+
 void Timeline::setSavePath(const string &path)
 {
     annotationPath = path;
+    saveToFile(annotationPath);
 }
 
-Annotations Timeline::yamlToAnnotations(const YAML::Node node)
+/** Reads the annotations at 'path', along with the changes journaled after they were saved */
+static bool readWithJournal(const string& path, Annotations& purple, Annotations& yellow)
 {
-    Annotations annotations;
+    uint64_t generation;
+    if (!readAnnotations(path, purple, yellow, generation)) return false;
 
-    for (const auto& as : node) {
-        for (const auto& a : as) {
-            auto type = annotationFromName(a.first.as<string>());
-            auto ts = a.second.as<vector<double>>();
-            annotations.add({type, ros::Time(ts[0]), ros::Time(ts[1])});
-        }
+    // changes made after this snapshot was saved, if any
+    if (generation) {
+        auto nbRecords = AnnotationJournal::replay(path + ".journal", generation, purple, yellow);
+        if (nbRecords > 0) qDebug() << "Replayed" << nbRecords << "changes from the annotation journal";
     }
-    return annotations;
+    // the replayed changes are already in the journal: they must not be journaled again
+    purple.takeChanges();
+    yellow.takeChanges();
+    return true;
 }
 
-void Timeline::loadFromFile(const string& path)
+bool Timeline::loadFromFile(const string& path)
 {
     qDebug() << "Loading " << QString::fromStdString(path);
 
     emit togglePause();
 
-    YAML::Node node = YAML::LoadFile(path);
-
+    // read aside: a file that can not be read must not replace the current annotations
+    Annotations purple, yellow;
+    if (!readWithJournal(path, purple, yellow)) {
+        QMessageBox::warning(this, "Load annotations", QString("Unable to load annotations from ") + QString::fromStdString(path));
+        return false;
+    }
 
-    purpleAnnotations = yamlToAnnotations(node["purple"]);
-    yellowAnnotations = yamlToAnnotations(node["yellow"]);
+    purpleAnnotations = move(purple);
+    yellowAnnotations = move(yellow);
+    savedPath_.clear();
 
     purpleAnnotations.lockAllCategories();
     yellowAnnotations.lockAllCategories();
 
     mergeMode = false;
+    annotationLayerValid_ = false;
     update();
+    return true;
 }
 
-void Timeline::mergeAnnotations(const string &path1, const string &path2)
+void Timeline::mergeAnnotations(const vector<string> &paths)
 {
-    qDebug() << "Loading " << QString::fromStdString(path1) << " and " << QString::fromStdString(path2) << " for merging";
+    emit togglePause();
+
+    // the current annotations (and merge, if any) are only replaced once a coder could be read
+    Consensus consensus;
+    if (addCoders(consensus, paths) == 0) return;
 
+    consensus_ = move(consensus);
+    // a new merge gets its own consensus file
+    mergeMode = false;
+    applyConsensus(paths.front());
+}
+
+void Timeline::addToMerge(const vector<string> &paths)
+{
     emit togglePause();
 
-    YAML::Node node1 = YAML::LoadFile(path1);
-    purpleAnnotations = yamlToAnnotations(node1["purple"]);
-    yellowAnnotations = yamlToAnnotations(node1["yellow"]);
-    YAML::Node node2 = YAML::LoadFile(path2);
-    purpleAnnotations2 = yamlToAnnotations(node2["purple"]);
-    yellowAnnotations2 = yamlToAnnotations(node2["yellow"]);
+    // the consensus is computed from the votes only: changes made to it since would be lost
+    auto revisions = make_pair(purpleAnnotations.revision(), yellowAnnotations.revision());
+    if (   revisions != consensusRevisions_
+        && QMessageBox::question(this, "Merge annotations",
+                                 "Adding coders computes the consensus again: the changes made to it will be lost. Continue?")
+           != QMessageBox::Yes) {
+        return;
+    }
+
+    if (addCoders(consensus_, paths) == 0) return;
 
-    purpleDiff = diff(purpleAnnotations, purpleAnnotations2);
-    yellowDiff = diff(yellowAnnotations, yellowAnnotations2);
+    applyConsensus(paths.front());
+}
+
+size_t Timeline::addCoders(Consensus &consensus, const vector<string> &paths)
+{
+    size_t nbAdded = 0;
+
+    for (const auto& path : paths) {
+        qDebug() << "Adding" << QString::fromStdString(path) << "to the merge";
+
+        Annotations purple, yellow;
+        if (!readWithJournal(path, purple, yellow)) {
+            QMessageBox::warning(this, "Merge annotations", QString("Unable to load the annotations to merge from ") + QString::fromStdString(path));
+            continue;
+        }
+        consensus.addCoder(purple, yellow);
+        nbAdded++;
+    }
+
+    return nbAdded;
+}
+
+void Timeline::applyConsensus(const string &coderPath)
+{
+    qDebug() << "Consensus of" << consensus_.nbCoders() << "coders";
+
+    purpleAnnotations = consensus_.annotations(StreamType::PURPLE);
+    yellowAnnotations = consensus_.annotations(StreamType::YELLOW);
+
+    // the coders' own files are left untouched: the consensus is autosaved to a file of its own
+    // (or not at all, if none is given)
+    if (!mergeMode) {
+        auto dir = QFileInfo(QString::fromStdString(coderPath)).path();
+        auto consensusPath = QFileDialog::getSaveFileName(this, tr("Save the consensus as"),
+                                                          dir + "/consensus.fpa",
+                                                          tr("Annotations (*.fpa)"));
+        annotationPath = consensusPath.toStdString();
+    }
+
+    // the journal refers to the annotations that were just replaced
+    savedPath_.clear();
+    saveToFile(annotationPath);
+    consensusRevisions_ = make_pair(purpleAnnotations.revision(), yellowAnnotations.revision());
 
     mergeMode = true;
+    annotationLayerValid_ = false;
     update();
 }
 
@@ -188,21 +370,58 @@ void Timeline::saveToFile(const string& path)
     auto actualpath = path;
     if(actualpath.empty()) actualpath = annotationPath;
 
-    YAML::Emitter out;
+    auto revisions = make_pair(purpleAnnotations.revision(), yellowAnnotations.revision());
+    if (actualpath == savedPath_ && revisions == savedRevisions_) return; // nothing changed since the last save
+
+    // saving to the autosave file compacts the journal into the snapshot
+    uint64_t generation = 0;
+    if (actualpath == annotationPath) {
+        // in case the snapshot can not be written, pending changes still go to the current journal
+        journalChanges();
+
+        generation = AnnotationJournal::newGeneration();
+        purpleAnnotations.compact();
+        yellowAnnotations.compact();
+        journalSize_ = 0;
+    }
 
-    std::time_t t = std::time(nullptr);
-    std::tm tm = *std::localtime(&t);
-    stringstream ss;
-    ss << "Annotations made by " << qgetenv("USER").toStdString() << " on the " << std::put_time(&tm, "%Y-%m-%d %H:%M:%S");
-    out << YAML::Comment(ss.str());
-    out << YAML::BeginMap;
-    out << YAML::Key << "purple" << YAML::Value << purpleAnnotations;
-    out << YAML::Key << "yellow" << YAML::Value << yellowAnnotations;
-    out << YAML::EndMap;
+    // the annotations are copied: serialization and writing happen in the background
+    writer_.saveSnapshot(actualpath, purpleAnnotations, yellowAnnotations, generation);
 
-    ofstream fout(actualpath);
-    fout << out.c_str();
-    //qDebug() << "Saved to " << QString::fromStdString(actualpath);
+    savedPath_ = actualpath;
+    savedRevisions_ = revisions;
+}
+
+void Timeline::journalChanges()
+{
+    string records;
+    journalSize_ += AnnotationJournal::format(StreamType::PURPLE, purpleAnnotations, purpleAnnotations.takeChanges(), records);
+    journalSize_ += AnnotationJournal::format(StreamType::YELLOW, yellowAnnotations, yellowAnnotations.takeChanges(), records);
+    writer_.appendToJournal(move(records));
+}
+
+void Timeline::retrySave(QString path)
+{
+    auto failed = path.toStdString();
+
+    // the annotations on disk are not the ones saved last anymore
+    if (failed == savedPath_) {
+        savedPath_.clear();
+        savedRevisions_ = make_pair(0, 0);
+    }
+    // the previous journal is still in use: compact it again at the next autosave
+    if (failed == annotationPath) journalSize_ = AnnotationJournal::COMPACTION_THRESHOLD + 1;
+
+    emit saveFailed(path);
+}
+
+void Timeline::autosave()
+{
+    if (annotationPath.empty()) return;
+
+    journalChanges();
+
+    if (journalSize_ > AnnotationJournal::COMPACTION_THRESHOLD) saveToFile(annotationPath);
 }
 
 void Timeline::paintEvent(QPaintEvent *event)
@@ -211,7 +430,8 @@ void Timeline::paintEvent(QPaintEvent *event)
     QPainter painter(this);
     painter.setRenderHint(QPainter::Antialiasing);
 
-    auto& rect = event->rect();
+    // the layout depends on the whole widget, even when only part of it is repainted
+    auto rect = this->rect();
 
     auto left = rect.left();
     auto right = rect.right();
@@ -252,15 +472,153 @@ void Timeline::placeFreeAnnotations() {
 
 void Timeline::drawTimeline(QPainter *painter, int left, int right, int top, int bottom) {
 
-    int yellowAnnotationOffset_ = top + 10;
-    int purpleAnnotationOffset_ = top + 60;
+    int width = right - left + 1;
+    int height = bottom + 20 - top + 1; // the time labels are drawn under the grid
+    auto startPx = startTime_ * pxPerSec_;
+
+    if (   layerPxPerSec_ != pxPerSec_
+        || backgroundLayer_.height() != height
+        || startPx < layerStartPx_
+        || startPx + width > layerStartPx_ + backgroundLayer_.width())
+    {
+        // the view scrolls with the playhead: leave some room on both sides
+        layerPxPerSec_ = pxPerSec_;
+        layerStartPx_ = std::max(0., startPx - width / 2);
+        backgroundLayer_ = QPixmap(width * LAYER_SPAN, height);
+        annotationLayer_ = QPixmap(width * LAYER_SPAN, height);
+        backgroundLayerValid_ = false;
+        annotationLayerValid_ = false;
+    }
+
+    if (!backgroundLayerValid_) {
+        renderBackgroundLayer(bottom - top);
+        backgroundLayerValid_ = true;
+    }
+
+    auto revisions = make_pair(purpleAnnotations.layoutRevision(), yellowAnnotations.layoutRevision());
+    if (!annotationLayerValid_ || revisions != layerRevisions_) {
+        renderAnnotationLayer();
+        annotationLayerValid_ = true;
+        layerRevisions_ = revisions;
+    }
+
+    QPointF layerPos(left - (startPx - layerStartPx_), top);
+    painter->drawPixmap(layerPos, backgroundLayer_);
+    painter->drawPixmap(layerPos, annotationLayer_);
+
+    // the active annotations change at every tick: they are drawn live
+    QFont font = this->font();
+    font.setPointSize(8);
+    painter->setFont(font);
+    QFontMetrics fm(font);
+
+    painter->save();
+    painter->translate(left, top);
+    for (auto handle : purpleAnnotations.active()) {
+        drawAnnotation(painter, fm, purpleAnnotations.at(handle), PURPLE_ANNOTATIONS_OFFSET, startTime_, width);
+    }
+    for (auto handle : yellowAnnotations.active()) {
+        drawAnnotation(painter, fm, yellowAnnotations.at(handle), YELLOW_ANNOTATIONS_OFFSET, startTime_, width);
+    }
+    painter->restore();
+
+    // playhead
+    painter->setPen(QPen(_color_playhead, 2));
+    painter->drawLine(QLine(left + (elapsedTime_ - startTime_) * pxPerSec_, top, left + (elapsedTime_ - startTime_) * pxPerSec_, bottom));
+
+
+}
+
+void Timeline::renderBackgroundLayer(int gridHeight)
+{
+    backgroundLayer_.fill(Qt::transparent);
+
+    QPainter painter(&backgroundLayer_);
+    painter.setRenderHint(QPainter::Antialiasing);
+    painter.setFont(font());
+
+    auto start = layerStartPx_ / pxPerSec_;
+    auto width = backgroundLayer_.width();
+
+    drawGrid(&painter, start, width, gridHeight);
+    drawFilmstrip(&painter, start, width, FILMSTRIP_OFFSET);
+    drawWaveform(&painter, start, width, WAVEFORM_OFFSET);
+}
+
+void Timeline::renderAnnotationLayer()
+{
+    annotationLayer_.fill(Qt::transparent);
+
+    QPainter painter(&annotationLayer_);
+    painter.setRenderHint(QPainter::Antialiasing);
+
+    QFont font = this->font();
+    font.setPointSize(8);
+    painter.setFont(font);
+    QFontMetrics fm(font);
+
+    auto start = layerStartPx_ / pxPerSec_;
+    auto width = annotationLayer_.width();
+
+    // in merge mode, these are the consensus tracks: conflicts are drawn with CONFLICT_PEN
+    drawAnnotations(&painter, fm, purpleAnnotations, PURPLE_ANNOTATIONS_OFFSET, start, width);
+    drawAnnotations(&painter, fm, yellowAnnotations, YELLOW_ANNOTATIONS_OFFSET, start, width);
+}
+
+void Timeline::drawAnnotations(QPainter *painter, const QFontMetrics& fm, const Annotations& annotations, int offset, double start, int width)
+{
+    auto from = begin_ + ros::Duration(start);
+    auto to = begin_ + ros::Duration(start + width / pxPerSec_);
+
+    // the active annotations are drawn separately
+    const auto& active = annotations.active();
+
+    for (auto category : AnnotationCategories) {
+
+        AnnotationBand band;
+
+        for (auto handle : annotations.range(category, from, to)) {
+            if (std::find(active.begin(), active.end(), handle) != active.end()) continue;
+
+            auto a = annotations.at(handle);
+            if (a.type == AnnotationType::MISSING) continue;
+
+            auto x1 = ((a.start - begin_).toSec() - start) * pxPerSec_;
+            auto x2 = ((a.stop - begin_).toSec() - start) * pxPerSec_;
+
+            if (x2 - x1 >= LOD_MIN_WIDTH) {
+                drawBand(painter, band, offset + categoryOffset(category));
+                band = AnnotationBand();
+                drawAnnotation(painter, fm, a, offset, start, width);
+                continue;
+            }
 
+            if (!band.durations.empty() && x1 > band.x2 + 1) {
+                drawBand(painter, band, offset + categoryOffset(category));
+                band = AnnotationBand();
+            }
+            if (band.durations.empty()) {
+                band.x1 = x1;
+                band.x2 = x2;
+            }
+            else band.x2 = std::max(band.x2, x2);
+            band.durations[{a.type, a.isConflicted}] += (a.stop - a.start).toSec();
+        }
+
+        drawBand(painter, band, offset + categoryOffset(category));
+    }
+}
+
+void Timeline::drawGrid(QPainter *painter, double start, int width, int height)
+{
     int major_increment = 60; int minor_increment = 30;
     if (pxPerSec_ > 2) {major_increment = 30; minor_increment = 10;}
     if (pxPerSec_ > 3) {major_increment = 20; minor_increment = 5;}
     if (pxPerSec_ > 7) {major_increment = 10; minor_increment = 2;}
     if (pxPerSec_ > 30) {major_increment = 5; minor_increment = 1;}
 
+    auto duration = width / pxPerSec_;
+
     // compute lines to draw
 
     std::vector<QLine> lines_light;
@@ -268,92 +626,186 @@ void Timeline::drawTimeline(QPainter *painter, int left, int right, int top, int
 
     painter->setPen(QPen(_color_light));
 
-    double offset = major_increment - fmod(startTime_, major_increment);
+    double offset = major_increment - fmod(start, major_increment);
 
-    for (double t = startTime_ - (major_increment - offset); t <= visibleDuration_ + startTime_; t += major_increment) {
+    for (double t = start - (major_increment - offset); t <= duration + start; t += major_increment) {
 
-        auto x = (t - startTime_) * pxPerSec_;
+        auto x = (t - start) * pxPerSec_;
 
-        if(x >= left) {
-            lines_light.push_back(QLine(x, top, x, bottom + 20));
-            painter->drawText(QPoint(x + 2, bottom + 20), QString("%1:%2").arg(static_cast<int>(round(t)) / 60,2,10,QChar('0')).arg(static_cast<int>(round(t)) % 60,2,10,QChar('0')));
+        if(x >= 0) {
+            lines_light.push_back(QLine(x, 0, x, height + 20));
+            painter->drawText(QPoint(x + 2, height + 20), QString("%1:%2").arg(static_cast<int>(round(t)) / 60,2,10,QChar('0')).arg(static_cast<int>(round(t)) % 60,2,10,QChar('0')));
         }
 
         for (auto tm = t + minor_increment; tm < t + major_increment; tm += minor_increment) {
-            auto x = (tm - startTime_) * pxPerSec_;
-            if(x >= left) lines_dark.push_back(QLine(x, top, x, bottom));
+            auto x = (tm - start) * pxPerSec_;
+            if(x >= 0) lines_dark.push_back(QLine(x, 0, x, height));
         }
 
     }
 
 
-    painter->fillRect(QRectF(left,top,right,bottom), _color_background);
+    painter->fillRect(QRectF(0,0,width,height), _color_background);
 
     // annotation zones
-    painter->fillRect(QRectF(left,purpleAnnotationOffset_ - 5,right,45), QColor("#4c2d64"));
-    painter->fillRect(QRectF(left,yellowAnnotationOffset_ - 5,right,45), QColor("#64592d"));
+    painter->fillRect(QRectF(0,PURPLE_ANNOTATIONS_OFFSET - 5,width,45), QColor("#4c2d64"));
+    painter->fillRect(QRectF(0,YELLOW_ANNOTATIONS_OFFSET - 5,width,45), QColor("#64592d"));
 
     // draw time
     painter->setPen(QPen(_color_light));
     painter->drawLines(lines_light.data(), lines_light.size());
     painter->setPen(QPen(_color_light.darker()));
     painter->drawLines(lines_dark.data(), lines_dark.size());
+}
 
+bool Timeline::drawFilmstrip(QPainter *painter, double start, int width, int top)
+{
+    if (!thumbnails_) return true;
 
+    auto startPx = start * pxPerSec_;
+    auto firstTile = static_cast<int>(floor(startPx / FILMSTRIP_TILE_WIDTH));
+    auto lastTile = static_cast<int>(floor((startPx + width) / FILMSTRIP_TILE_WIDTH));
 
-    // Drawing of annotations
-    QFont font = painter->font() ;
-    font.setPointSize(8);
-    painter->setFont(font);
+    // tiles are rendered lazily, a few at a time, to keep the GUI responsive
+    // when zooming
+    int nbRendered = 0;
+    bool missingTiles = false;
 
-    if (!mergeMode) {
-        for(const auto a : purpleAnnotations) drawAnnotation(painter, a, purpleAnnotationOffset_, left);
-        for(const auto a : yellowAnnotations) drawAnnotation(painter, a, yellowAnnotationOffset_, left);
+    for (auto tile = firstTile; tile <= lastTile; tile++) {
+        auto key = QString("filmstrip-%1-%2-%3-%4").arg(pxPerSec_).arg(tile).arg(filmstripGeneration_).arg(filmstripRevision(tile));
+
+        QPixmap pixmap;
+        if (!QPixmapCache::find(key, &pixmap)) {
+            if (nbRendered >= FILMSTRIP_MAX_TILES_PER_PAINT) {
+                missingTiles = true;
+                continue;
+            }
+            pixmap = renderFilmstripTile(tile);
+            QPixmapCache::insert(key, pixmap);
+            nbRendered++;
+        }
+
+        painter->drawPixmap(QPointF(tile * FILMSTRIP_TILE_WIDTH - startPx, top), pixmap);
     }
-    else {
-        for(const auto a : purpleAnnotations) drawAnnotation(painter, a, purpleAnnotationOffset_, left);
-        for(const auto a : purpleAnnotations2) drawAnnotation(painter, a, purpleAnnotationOffset_ + 20, left);
-        for(const auto a : purpleDiff) drawAnnotation(painter, a, purpleAnnotationOffset_ + 35, left, true);
 
+    if (missingTiles && !filmstripTimer_.isActive()) filmstripTimer_.start();
+
+    return !missingTiles;
+}
+
+uint32_t Timeline::filmstripRevision(int tile) const
+{
+    // the thumbnails drawn on a tile may start up to one thumbnail before it
+    int thumbnailWidth = FILMSTRIP_HEIGHT * 16 / 9;
+    auto from = (tile * FILMSTRIP_TILE_WIDTH - thumbnailWidth) / pxPerSec_;
+    auto to = ((tile + 1) * FILMSTRIP_TILE_WIDTH + thumbnailWidth) / pxPerSec_;
+
+    auto first = static_cast<size_t>(std::max(0., from / FILMSTRIP_BUCKET_DURATION));
+    auto last = std::min(filmstripRevisions_.size(), static_cast<size_t>(std::max(0., to / FILMSTRIP_BUCKET_DURATION)) + 1);
+
+    // revisions only increase: the sum changes whenever one of them does
+    uint32_t revision = 0;
+    for (auto b = first; b < last; b++) revision += filmstripRevisions_[b];
+    return revision;
+}
+
+void Timeline::refreshFilmstrip()
+{
+    // a layer that is about to be rendered again will pick the new tiles up anyway
+    if (!backgroundLayerValid_ || layerPxPerSec_ != pxPerSec_) return;
+
+    // only the outdated tiles are rendered again: as they are opaque and
+    // cover the grid below them, they are drawn straight into the layer
+    QPainter painter(&backgroundLayer_);
+    painter.setRenderHint(QPainter::Antialiasing);
+    drawFilmstrip(&painter, layerStartPx_ / pxPerSec_, backgroundLayer_.width(), FILMSTRIP_OFFSET);
+    painter.end();
+
+    update();
+}
+
+QPixmap Timeline::renderFilmstripTile(int tile)
+{
+    QPixmap pixmap(FILMSTRIP_TILE_WIDTH, FILMSTRIP_HEIGHT);
+    pixmap.fill(_color_background.darker());
+
+    QPainter painter(&pixmap);
+
+    // thumbnails are laid out on a grid starting at the beginning of the bag,
+    // independent of the tiles
+    int thumbnailWidth = FILMSTRIP_HEIGHT * 16 / 9;
+    int tileStart = tile * FILMSTRIP_TILE_WIDTH;
+
+    for (int slot = tileStart / thumbnailWidth; slot * thumbnailWidth < tileStart + FILMSTRIP_TILE_WIDTH; slot++) {
+        auto time = begin_ + ros::Duration((slot + 0.5) * thumbnailWidth / pxPerSec_);
+        if (time > end_) break;
+
+        auto thumbnail = thumbnails_->thumbnail(VideoStream::ENV, time);
+        if (thumbnail.isNull()) continue;
+
+        painter.drawImage(QRect(slot * thumbnailWidth - tileStart, 0, thumbnailWidth - 1, FILMSTRIP_HEIGHT), thumbnail);
     }
-    
-    // playhead
-    painter->setPen(QPen(_color_playhead, 2));
-    painter->drawLine(QLine(left + (elapsedTime_ - startTime_) * pxPerSec_, top, left + (elapsedTime_ - startTime_) * pxPerSec_, bottom));
 
+    return pixmap;
+}
+
+void Timeline::drawWaveform(QPainter *painter, double start, int width, int top)
+{
+    if (!waveform_) return;
+
+    auto amplitude = waveform_->maxAmplitude();
+    if (amplitude <= 0.f) return;
+
+    // one peak per pixel
+    auto peaks = waveform_->peaks(begin_ + ros::Duration(start),
+                                  ros::Duration(1. / pxPerSec_),
+                                  width);
+
+    auto scale = (WAVEFORM_HEIGHT / 2) / amplitude;
+    auto middle = top + WAVEFORM_HEIGHT / 2;
+
+    std::vector<QLineF> lines_peak;
+    std::vector<QLineF> lines_rms;
+    lines_peak.reserve(peaks.size());
+    lines_rms.reserve(peaks.size());
+
+    for (size_t i = 0; i < peaks.size(); i++) {
+        const auto& peak = peaks[i];
+        if (peak.isEmpty()) continue;
+
+        auto x = i;
+        auto rms = sqrt(peak.meansquare);
+        lines_peak.push_back(QLineF(x, middle - peak.max * scale, x, middle - peak.min * scale));
+        lines_rms.push_back(QLineF(x, middle - rms * scale, x, middle + rms * scale));
+    }
 
+    painter->setPen(QPen(_color_light));
+    painter->drawLines(lines_peak.data(), lines_peak.size());
+    painter->setPen(QPen(_color_bg_text));
+    painter->drawLines(lines_rms.data(), lines_rms.size());
 }
 
 void Timeline::drawAnnotation(QPainter *painter,
-                              AnnotationConstPtr a,
+                              const QFontMetrics& fm,
+                              const Annotation& a,
                               int offset,
-                              int left,
-                              bool isDiff) {
-
-        if(a->type == AnnotationType::MISSING) return;
-
-        if(isDiff && !a->isConflicted) return;
+                              double start,
+                              int width) {
 
-        if(mergeMode && a->category() != AnnotationCategory::TASK_ENGAGEMENT) return;
+        if(a.type == AnnotationType::MISSING) return;
 
         int radius = 4;
-        QFontMetrics fm(painter->font());
 
-        auto categoryOffset = 5;
-        if(a->category() == AnnotationCategory::SOCIAL_ENGAGEMENT) categoryOffset = 20;
-        else if(a->category() == AnnotationCategory::SOCIAL_ATTITUDE) categoryOffset = 35;
+        auto y = offset + categoryOffset(a.category());
 
-        auto y = offset + categoryOffset;
+        auto x1 = std::max(0., ((a.start - begin_).toSec() - start) * pxPerSec_);
+        auto x2 = std::min(((a.stop - begin_).toSec() - start) * pxPerSec_, static_cast<double>(width));
+        if (x2 < 0 || x1 > width) return;
 
-        auto start = std::max(0., (a->start - begin_).toSec() - startTime_);
-        auto stop = std::min((a->stop - begin_).toSec() - startTime_, startTime_ + visibleDuration_);
-        auto x1 = left + start * pxPerSec_;
-        auto x2 = left + stop * pxPerSec_;
-
-        if (a->isConflicted)
+        if (a.isConflicted)
             painter->setPen(Annotation::CONFLICT_PEN);
         else
-            painter->setPen(Annotation::Styles[a->type]);
+            painter->setPen(Annotation::Styles[a.type]);
         painter->drawLine(x1, y, x2-2, y);
 
         QPen capsPen(painter->pen());
@@ -362,9 +814,9 @@ void Timeline::drawAnnotation(QPainter *painter,
         painter->drawLine(x1, y - radius/2, x1, y + radius/2);
         painter->drawLine(x2-2, y - radius/2, x2-2, y + radius/2);
 
-        int annotationNameWidth = fm.width(QString::fromStdString(a->name()));
-        if ((x2-x1) > annotationNameWidth + 5) {
-            painter->drawText(QPoint(x1 + 2, y - 2), QString::fromStdString(a->name()));
+        auto name = QString::fromStdString(a.name());
+        if ((x2-x1) > fm.width(name) + 5) {
+            painter->drawText(QPoint(x1 + 2, y - 2), name);
         }
 
 }
@@ -387,6 +839,20 @@ void Timeline::keyPressEvent(QKeyEvent *event) {
         if (timescale_ < 1.) timescale_ = 1.;
         break;
 
+    case Qt::Key_Plus:
+    case Qt::Key_Equal:
+        emit faster();
+        break;
+    case Qt::Key_Minus:
+        emit slower();
+        break;
+    case Qt::Key_Left:
+        emit stepFrame(-1);
+        break;
+    case Qt::Key_Right:
+        emit stepFrame(1);
+        break;
+
     case Qt::Key_Q:
         purpleAnnotations.add({AnnotationType::PROSOCIAL, current_, current_});
         break;
@@ -405,12 +871,11 @@ void Timeline::keyPressEvent(QKeyEvent *event) {
             emit togglePause();
             QString fileName = QFileDialog::getSaveFileName(this, tr("Save annotations to..."),
                                     "",
-                                    tr("Annotations (*.yaml)"));
+                                    tr("Annotations (*.fpa *.yaml)"));
             emit togglePause();
 
             if(!fileName.isEmpty()) {
-                annotationPath = fileName.toStdString();
-                saveToFile(annotationPath);
+                setSavePath(fileName.toStdString());
             }
         }
         else {
@@ -431,16 +896,17 @@ void Timeline::keyPressEvent(QKeyEvent *event) {
         if(QApplication::keyboardModifiers() && Qt::ControlModifier) // ctrl+o
         {
             emit pause();
-            QStringList fileNames = QFileDialog::getOpenFileNames(this, tr("Load annotations (select 2 for merge mode)"),
+            QStringList fileNames = QFileDialog::getOpenFileNames(this, tr("Load annotations (select several for merge mode)"),
                                                             "",
-                                                            tr("Annotations (*.yaml)"));
+                                                            tr("Annotations (*.fpa *.yaml)"));
             if(fileNames.size() == 1) {
-                annotationPath = fileNames[0].toStdString();
-                loadFromFile(annotationPath);
+                // only autosave to a file that could be loaded: it would be overwritten otherwise
+                if (loadFromFile(fileNames[0].toStdString())) setSavePath(fileNames[0].toStdString());
             }
-            else if(fileNames.size() == 2) {
-                mergeAnnotations(fileNames[0].toStdString(), fileNames[1].toStdString());
-
+            else if(fileNames.size() > 1) {
+                vector<string> paths;
+                for (const auto& fileName : fileNames) paths.push_back(fileName.toStdString());
+                mergeAnnotations(paths);
             }
         }
         else {
@@ -456,6 +922,18 @@ void Timeline::keyPressEvent(QKeyEvent *event) {
      case Qt::Key_L:
         yellowAnnotations.add({AnnotationType::AIMLESS, current_, current_});
         break;
+    case Qt::Key_M:
+        if(mergeMode && QApplication::keyboardModifiers() && Qt::ControlModifier) // ctrl+m
+        {
+            emit pause();
+            QStringList fileNames = QFileDialog::getOpenFileNames(this, tr("Add coders to the merge"),
+                                                            "",
+                                                            tr("Annotations (*.fpa *.yaml)"));
+            vector<string> paths;
+            for (const auto& fileName : fileNames) paths.push_back(fileName.toStdString());
+            if (!paths.empty()) addToMerge(paths);
+        }
+        break;
      case Qt::Key_X:
      case Qt::Key_Delete:
         clearAllAnnotations();
@@ -468,14 +946,32 @@ void Timeline::keyPressEvent(QKeyEvent *event) {
 }
 
 void Timeline::mousePressEvent(QMouseEvent *event)
+{
+    // the jump itself waits for the release: a click and a drag both end with a single seek
+    if (event->button() == Qt::LeftButton) pressPos_ = event->pos();
+}
+
+void Timeline::mouseMoveEvent(QMouseEvent *event)
+{
+    if (!(event->buttons() & Qt::LeftButton)) return;
+
+    // a click that jitters by a few pixels is not a drag
+    if (!scrubbing_ && (event->pos() - pressPos_).manhattanLength() < QApplication::startDragDistance()) return;
+
+    scrubbing_ = true;
+    emit scrub(pointToTimestamp(event->pos()));
+}
+
+void Timeline::mouseReleaseEvent(QMouseEvent *event)
 {
     if (event->button() == Qt::LeftButton) {
-            auto lastPoint = event->pos();
-            emit timeJump(pointToTimestamp(lastPoint));
+        // a click seeks where it was pressed, a drag where it ended
+        auto pos = scrubbing_ ? event->pos() : pressPos_;
+        scrubbing_ = false;
+        emit timeJump(pointToTimestamp(pos));
     }
 }
 
-
 void Timeline::wheelEvent(QWheelEvent *event) {
         //setTransformationAnchor(QGraphicsView::AnchorUnderMouse);
         double scaleFactor = 1.25;
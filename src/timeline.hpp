@@ -6,13 +6,20 @@
 
 #include <QWidget>
 #include <QPen>
+#include <QPixmap>
 #include <QTimer>
 
 #include <ros/time.h>
 
 #include "annotation.hpp"
+#include "annotationjournal.hpp"
+#include "annotationwriter.hpp"
+#include "consensus.hpp"
 #include "freeannotationwidget.hpp"
 
+class ThumbnailCache;
+class AudioWaveform;
+
 class Timeline : public QWidget {
     Q_OBJECT
 
@@ -20,8 +27,14 @@ class Timeline : public QWidget {
     Timeline(QWidget* parent = nullptr);
 
     Q_SIGNAL void timeJump(ros::Time timepoint);
+    /** emitted while the playhead is dragged: the playback only jumps once released */
+    Q_SIGNAL void scrub(ros::Time timepoint);
     Q_SIGNAL void togglePause();
     Q_SIGNAL void pause();
+    Q_SIGNAL void faster();
+    Q_SIGNAL void slower();
+    /** emitted to move frame by frame through the env camera */
+    Q_SIGNAL void stepFrame(int frames);
 
     Q_SLOT void initialize(ros::Time begin, ros::Time end);
     Q_SLOT void setPlayhead(ros::Time time);
@@ -29,18 +42,43 @@ class Timeline : public QWidget {
     Q_SLOT void newAnnotation(StreamType stream, AnnotationType annotation);
     Q_SLOT void clearAllAnnotations();
 
+    /** Sets the file the annotations are autosaved to, and saves them */
     Q_SLOT void setSavePath(const std::string &path);
     Q_SLOT void saveToFile(const std::string &path);
-
-    Q_SLOT void loadFromFile(const std::string &path);
-    Q_SLOT void mergeAnnotations(const std::string &path1, const std::string &path2);
+    /** Appends the changes made since the last autosave to the journal */
+    Q_SLOT void autosave();
+    /** emitted once the annotations are written to disk, with the time it took (in ms) */
+    Q_SIGNAL void saved(QString path, double latency);
+    /** emitted when the annotations could not be written to 'path' */
+    Q_SIGNAL void saveFailed(QString path);
+
+    /**
+     * Loads the annotations at 'path' (and replays their journal). On failure,
+     * the current annotations are left untouched, and false is returned.
+     */
+    Q_SLOT bool loadFromFile(const std::string &path);
+    /** Enters merge mode: the annotations become the consensus of the coders at 'paths' */
+    Q_SLOT void mergeAnnotations(const std::vector<std::string> &paths);
+    /** Adds more coders to the current consensus, without recomputing the previous ones */
+    Q_SLOT void addToMerge(const std::vector<std::string> &paths);
 
     void resetAnnotations();
 
+    /** Sets the thumbnails used to draw the filmstrip of the env camera under the annotations */
+    void setThumbnailCache(const ThumbnailCache* thumbnails);
+    /** Refreshes the filmstrip tiles covering [from, to] */
+    Q_SLOT void thumbnailsUpdated(ros::Time from, ros::Time to);
+
+    /** Sets the audio envelope drawn as a waveform lane at the bottom of the timeline */
+    void setAudioWaveform(const AudioWaveform* waveform);
+    Q_SLOT void waveformUpdated();
+
 protected:
     virtual void paintEvent(QPaintEvent *event) override;
     virtual void keyPressEvent(QKeyEvent* event) override;
     virtual void mousePressEvent(QMouseEvent* event) override;
+    virtual void mouseMoveEvent(QMouseEvent* event) override;
+    virtual void mouseReleaseEvent(QMouseEvent* event) override;
     virtual void wheelEvent(QWheelEvent* event) override;
 
    private:
@@ -65,23 +103,70 @@ protected:
     Annotations purpleAnnotations;
     Annotations yellowAnnotations;
 
-    // in merge mode, we have a second set of annotations + a diff
+    // in merge mode, the annotations above are the consensus of several coders
     bool mergeMode;
-    Annotations purpleAnnotations2;
-    Annotations yellowAnnotations2;
-    Annotations purpleDiff;
-    Annotations yellowDiff;
+    Consensus consensus_;
+    std::pair<uint64_t, uint64_t> consensusRevisions_; // of the annotations, when the consensus was last computed
+    /** reads the annotations at 'paths' and adds them to 'consensus'. Returns the number of coders added */
+    size_t addCoders(Consensus& consensus, const std::vector<std::string>& paths);
+    /** replaces the annotations with the consensus (the first merge asks where to save it, next to 'coderPath') */
+    void applyConsensus(const std::string& coderPath);
     //////////////////////////////////////////////////////////////
 
-    Annotations yamlToAnnotations(const YAML::Node node);
+    bool scrubbing_;
+    QPoint pressPos_; // where the left button was pressed, to tell clicks from drags
 
     std::vector<std::shared_ptr<FreeAnnotationWidget>> freeAnnotations;
     void placeFreeAnnotations();
     void drawTimeline(QPainter *painter, int left, int right, int top, int bottom);
 
+    // The grid, lanes, filmstrip and waveform on one hand, and the annotations
+    // (except the active ones) on the other, are rendered into layers wider
+    // than the widget, that are only re-rendered on zoom, resize, once the view
+    // scrolls out of them, or when their content changes. Otherwise, painting
+    // only blits them, and draws the playhead and the active annotations.
+    QPixmap backgroundLayer_;
+    QPixmap annotationLayer_;
+    double layerStartPx_; // from the beginning of the bag
+    double layerPxPerSec_;
+    bool backgroundLayerValid_;
+    bool annotationLayerValid_;
+    std::pair<uint64_t, uint64_t> layerRevisions_; // layout revisions of the purple and yellow annotations
+    void renderBackgroundLayer(int gridHeight);
+    void renderAnnotationLayer();
+    /** draws the visible annotations, except the active ones, merging the ones narrower than a few pixels */
+    void drawAnnotations(QPainter *painter, const QFontMetrics& fm, const Annotations& annotations, int offset, double start, int width);
+    void drawGrid(QPainter *painter, double start, int width, int height);
+
+    const ThumbnailCache* thumbnails_;
+    int filmstripGeneration_; // incremented when the thumbnail cache is replaced
+    // incremented, per FILMSTRIP_BUCKET_DURATION of the bag, when thumbnails
+    // change: a cached tile only needs to be rendered again if one of the
+    // buckets it covers was updated
+    std::vector<uint32_t> filmstripRevisions_;
+    uint32_t filmstripRevision(int tile) const;
+    // the missing or outdated tiles are drawn into the background layer by a
+    // throttled refresh, instead of rendering the whole layer again
+    QTimer filmstripTimer_;
+    void refreshFilmstrip();
+    /** returns false if some tiles are not rendered yet (a refresh is then scheduled) */
+    bool drawFilmstrip(QPainter *painter, double start, int width, int top);
+    QPixmap renderFilmstripTile(int tile);
+
+    const AudioWaveform* waveform_;
+    void drawWaveform(QPainter *painter, double start, int width, int top);
+
     QTimer autosaveTimer;
     std::string annotationPath;
-    void drawAnnotation(QPainter *painter, AnnotationConstPtr a, int offset, int left, bool isDiff=false);
+    AnnotationWriter writer_;
+    size_t journalSize_; // records since the last snapshot
+    void journalChanges();
+    /** schedules another attempt at a snapshot that could not be written */
+    void retrySave(QString path);
+    std::string savedPath_;
+    std::pair<uint64_t, uint64_t> savedRevisions_; // of the purple and yellow annotations, when last saved
+    /** draws 'a' with x=0 at 'start' (in seconds from the beginning of the bag), clipped to 'width' */
+    void drawAnnotation(QPainter *painter, const QFontMetrics& fm, const Annotation& a, int offset, double start, int width);
 };
 
 #endif
@@ -0,0 +1,301 @@
+/* See LICENSE file for copyright and license details. */
+
+/**
+ * Batch inter-rater agreement over a corpus of annotation files.
+ *
+ * Scans a directory for '<bag>.annotations.<coder>.{fpa,yaml}' files, pairs
+ * the coders of each bag, and computes, for each child and each category:
+ *  - the time-weighted agreement: share of the time annotated by either
+ *    coder during which both chose the same annotation,
+ *  - Cohen's kappa, over the time annotated by both coders (time-weighted),
+ *  - the (time-weighted) confusion matrix.
+ * Sessions are processed in parallel. The report also pools all the
+ * sessions per category.
+ *
+ * Usage: freeplay-agreement <directory> [-o <report>] [-j <threads>]
+ */
+
+#include <algorithm>
+#include <condition_variable>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <regex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <QDirIterator>
+
+#include "annotation.hpp"
+#include "annotationio.hpp"
+#include "annotationjournal.hpp"
+#include "taskpool.hpp"
+
+using namespace std;
+
+typedef map<pair<AnnotationType, AnnotationType>, double> ConfusionMatrix; // seconds
+
+struct Comparison {
+    string session;
+    string coder1, coder2;
+    StreamType child;
+    AnnotationCategory category;
+
+    ConfusionMatrix confusion; // time both coders annotated
+    double annotated = 0.; // time either coder annotated
+};
+
+struct Coding {
+    Annotations purple, yellow;
+};
+
+const map<AnnotationCategory, string> CategoryNames {
+    {AnnotationCategory::TASK_ENGAGEMENT, "task engagement"},
+    {AnnotationCategory::SOCIAL_ENGAGEMENT, "social engagement"},
+    {AnnotationCategory::SOCIAL_ATTITUDE, "social attitude"}
+};
+
+void compare(const Annotations& annotations1, const Annotations& annotations2, Comparison& res)
+{
+    AnnotationCursor c1(annotations1, res.category), c2(annotations2, res.category);
+
+    auto time = min(c1.first(), c2.first());
+    while (time < ros::TIME_MAX) {
+        auto type1 = c1.at(time);
+        auto type2 = c2.at(time);
+        auto next = min(c1.next(time), c2.next(time));
+        if (next == ros::TIME_MAX) break;
+
+        auto duration = (next - time).toSec();
+        if (type1 != AnnotationType::MISSING || type2 != AnnotationType::MISSING) res.annotated += duration;
+        if (type1 != AnnotationType::MISSING && type2 != AnnotationType::MISSING) res.confusion[{type1, type2}] += duration;
+
+        time = next;
+    }
+}
+
+double agreement(const Comparison& c)
+{
+    double agreed = 0.;
+    for (const auto& kv : c.confusion) {
+        if (kv.first.first == kv.first.second) agreed += kv.second;
+    }
+    return c.annotated > 0. ? agreed / c.annotated : 0.;
+}
+
+double kappa(const ConfusionMatrix& confusion)
+{
+    double total = 0., agreed = 0.;
+    map<AnnotationType, double> rows, cols;
+    for (const auto& kv : confusion) {
+        total += kv.second;
+        if (kv.first.first == kv.first.second) agreed += kv.second;
+        rows[kv.first.first] += kv.second;
+        cols[kv.first.second] += kv.second;
+    }
+    if (total == 0.) return 0.;
+
+    double po = agreed / total;
+    double pe = 0.;
+    for (const auto& kv : rows) {
+        auto it = cols.find(kv.first);
+        if (it != cols.end()) pe += kv.second * it->second;
+    }
+    pe /= total * total;
+
+    return pe < 1. ? (po - pe) / (1. - pe) : 1.;
+}
+
+bool loadCoding(const string& path, Coding& coding)
+{
+    uint64_t generation;
+    if (!readAnnotations(path, coding.purple, coding.yellow, generation)) return false;
+    if (generation) AnnotationJournal::replay(path + ".journal", generation, coding.purple, coding.yellow);
+    return true;
+}
+
+void printConfusion(ostream& out, const ConfusionMatrix& confusion)
+{
+    if (confusion.empty()) {
+        out << "(no time annotated by both coders)\n";
+        return;
+    }
+
+    vector<AnnotationType> types;
+    for (const auto& kv : confusion) {
+        for (auto t : {kv.first.first, kv.first.second}) {
+            if (find(types.begin(), types.end(), t) == types.end()) types.push_back(t);
+        }
+    }
+    sort(types.begin(), types.end());
+
+    out << setw(16) << "";
+    for (auto t : types) out << setw(14) << AnnotationNames.at(t).first;
+    out << "\n";
+    for (auto t1 : types) {
+        out << setw(16) << AnnotationNames.at(t1).first;
+        for (auto t2 : types) {
+            auto it = confusion.find({t1, t2});
+            out << setw(14) << fixed << setprecision(1) << (it == confusion.end() ? 0. : it->second);
+        }
+        out << "\n";
+    }
+}
+
+static int usage(const char *program)
+{
+    cerr << "Usage: " << program << " <directory> [-o <report>] [-j <threads>]" << endl;
+    return 1;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) return usage(argv[0]);
+
+    string directory = argv[1];
+    string reportPath;
+    size_t nbThreads = thread::hardware_concurrency();
+    for (int i = 2; i < argc; i += 2) {
+        string opt = argv[i];
+        if (i + 1 == argc) return usage(argv[0]); // option without a value
+
+        string value = argv[i + 1];
+        if (opt == "-o") {
+            reportPath = value;
+        }
+        else if (opt == "-j") {
+            size_t end = 0;
+            try {
+                nbThreads = stoul(value, &end);
+            }
+            catch (const logic_error&) { // not a number, or out of range
+                end = 0;
+            }
+            if (end == 0 || end != value.size() || nbThreads == 0) return usage(argv[0]);
+        }
+        else {
+            return usage(argv[0]);
+        }
+    }
+
+    // opened before the (long) comparison, so that a bad path is reported straight away
+    ofstream reportFile;
+    if (!reportPath.empty()) {
+        reportFile.open(reportPath);
+        if (!reportFile) {
+            cerr << "Unable to write the report to " << reportPath << endl;
+            return 1;
+        }
+    }
+
+    // session (bag) -> coder -> annotation file. Binary files are preferred over YAML ones.
+    map<string, map<string, string>> sessions;
+    const regex pattern("(.*)\\.annotations\\.(.+)\\.(fpa|yaml|yml)");
+
+    QDirIterator it(QString::fromStdString(directory), QDir::Files, QDirIterator::Subdirectories);
+    while (it.hasNext()) {
+        auto path = it.next().toStdString();
+        smatch m;
+        if (!regex_match(path, m, pattern)) continue;
+
+        auto& file = sessions[m[1]][m[2]];
+        if (file.empty() || m[3] == "fpa") file = path;
+    }
+
+    // one task per pair of coders of a session
+    vector<pair<string, pair<string, string>>> pairs;
+    for (const auto& session : sessions) {
+        for (auto c1 = session.second.begin(); c1 != session.second.end(); ++c1) {
+            for (auto c2 = next(c1); c2 != session.second.end(); ++c2) {
+                pairs.push_back({session.first, {c1->second, c2->second}});
+            }
+        }
+    }
+
+    cerr << "Found " << sessions.size() << " sessions, " << pairs.size() << " pairs of coders" << endl;
+
+    vector<vector<Comparison>> results(pairs.size());
+
+    mutex doneMutex;
+    condition_variable done;
+    size_t remaining = pairs.size();
+
+    {
+        TaskPool pool(max<size_t>(1, nbThreads));
+
+        for (size_t i = 0; i < pairs.size(); i++) {
+            pool.submit([&, i]() {
+                const auto& p = pairs[i];
+                Coding coding1, coding2;
+                smatch m1, m2;
+                regex_match(p.second.first, m1, pattern);
+                regex_match(p.second.second, m2, pattern);
+
+                if (loadCoding(p.second.first, coding1) && loadCoding(p.second.second, coding2)) {
+                    for (auto child : {StreamType::PURPLE, StreamType::YELLOW}) {
+                        for (auto category : AnnotationCategories) {
+                            Comparison c;
+                            c.session = p.first;
+                            c.coder1 = m1[2];
+                            c.coder2 = m2[2];
+                            c.child = child;
+                            c.category = category;
+                            if (child == StreamType::PURPLE) compare(coding1.purple, coding2.purple, c);
+                            else compare(coding1.yellow, coding2.yellow, c);
+                            results[i].push_back(move(c));
+                        }
+                    }
+                }
+                else {
+                    cerr << "Skipping " << p.second.first << " / " << p.second.second << endl;
+                }
+
+                lock_guard<mutex> lock(doneMutex);
+                if (--remaining == 0) done.notify_all();
+            });
+        }
+
+        unique_lock<mutex> lock(doneMutex);
+        done.wait(lock, [&]{return remaining == 0;});
+    }
+
+    ostream& out = reportPath.empty() ? cout : reportFile;
+
+    out << "# Inter-rater agreement: " << sessions.size() << " sessions, " << pairs.size() << " pairs of coders\n\n";
+    out << left << setw(40) << "session" << setw(24) << "coders" << setw(8) << "child"
+        << setw(20) << "category" << right << setw(12) << "annotated" << setw(12) << "agreement" << setw(10) << "kappa" << "\n";
+
+    map<AnnotationCategory, Comparison> pooled;
+
+    for (const auto& comparisons : results) {
+        for (const auto& c : comparisons) {
+            out << left << setw(40) << c.session << setw(24) << (c.coder1 + "/" + c.coder2)
+                << setw(8) << (c.child == StreamType::PURPLE ? "purple" : "yellow")
+                << setw(20) << CategoryNames.at(c.category) << right << fixed << setprecision(1)
+                << setw(11) << c.annotated << "s" << setprecision(3)
+                << setw(12) << agreement(c) << setw(10) << kappa(c.confusion) << "\n";
+
+            auto& p = pooled[c.category];
+            p.annotated += c.annotated;
+            for (const auto& kv : c.confusion) p.confusion[kv.first] += kv.second;
+        }
+    }
+
+    out << "\n# Pooled over all sessions\n";
+    for (const auto& kv : pooled) {
+        out << "\n## " << CategoryNames.at(kv.first) << ": agreement " << fixed << setprecision(3) << agreement(kv.second)
+            << ", kappa " << kappa(kv.second.confusion) << "\n\n";
+        printConfusion(out, kv.second.confusion);
+    }
+
+    if (!out.flush()) {
+        cerr << "Unable to write the report to " << (reportPath.empty() ? "the standard output" : reportPath) << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,76 @@
+/*
+ * Compares the fused rotate + BGR->RGB kernel used by the Converter with
+ * the previous OpenCV path (transpose, flip, then cvtColor), for every
+ * rotation and every instruction set supported by the CPU.
+ *
+ * Usage: freeplay-pixelkernels-benchmark [width height [iterations]]
+ */
+
+#include <chrono>
+#include <iostream>
+#include <string>
+
+#include <opencv2/opencv.hpp>
+
+#include "pixelkernels.hpp"
+
+using namespace std;
+using namespace std::chrono;
+
+static void opencvPath(const cv::Mat& frame, cv::Mat& dest, int quarterTurns)
+{
+    switch (quarterTurns) {
+    case 1: cv::flip(frame.t(), dest, 1); break;
+    case 2: cv::flip(frame, dest, -1); break;
+    case 3: cv::flip(frame.t(), dest, 0); break;
+    default: dest = frame.clone();
+    }
+    cv::cvtColor(dest, dest, CV_BGR2RGB);
+}
+
+static void fusedPath(const cv::Mat& frame, cv::Mat& dest, int quarterTurns)
+{
+    dest.create(quarterTurns % 2 ? frame.cols : frame.rows,
+                quarterTurns % 2 ? frame.rows : frame.cols,
+                CV_8UC3);
+    rotatePixels(frame.data, frame.cols, frame.rows, frame.step, dest.data, dest.step, quarterTurns, true);
+}
+
+template<typename F>
+static double timeIt(F f, int iterations)
+{
+    auto start = steady_clock::now();
+    for (int i = 0; i < iterations; i++) f();
+    return duration<double, milli>(steady_clock::now() - start).count() / iterations;
+}
+
+int main(int argc, char* argv[])
+{
+    int width = argc > 2 ? stoi(argv[1]) : 1920;
+    int height = argc > 2 ? stoi(argv[2]) : 1080;
+    int iterations = argc > 3 ? stoi(argv[3]) : 100;
+
+    cv::Mat frame(height, width, CV_8UC3);
+    cv::randu(frame, cv::Scalar::all(0), cv::Scalar::all(255));
+
+    cout << width << "x" << height << ", " << iterations << " iterations (ms per frame)" << endl;
+
+    for (int turns = 0; turns < 4; turns++) {
+        cv::Mat expected, actual;
+
+        auto reference = timeIt([&]{opencvPath(frame, expected, turns);}, iterations);
+        cout << "rotation " << 90 * turns << " deg: opencv " << reference;
+
+        for (auto isa : {KernelISA::SCALAR, KernelISA::SSSE3, KernelISA::AVX2}) {
+            if (!setKernelISA(isa)) continue;
+
+            auto fused = timeIt([&]{fusedPath(frame, actual, turns);}, iterations);
+            bool identical = cv::norm(expected, actual, cv::NORM_INF) == 0;
+
+            cout << ", " << kernelISAName(isa) << " " << fused << (identical ? "" : " (MISMATCH)");
+        }
+        cout << endl;
+    }
+
+    return 0;
+}